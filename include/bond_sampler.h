@@ -0,0 +1,207 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <stdint.h>
+
+enum class bond_sampling
+{
+  per_bond,       // One engine call per bond: rng() < bound
+  bit_masks,      // Bit-sliced comparison, 64 bonds at a time
+  geometric_gaps, // Jump straight to the next open bond, one engine call per open bond
+};
+
+/*
+Generates packed masks of open bonds: each bit is set independently with probability bound / 2^64, i.e. exactly the distribution
+of rng() < bound with a 64 bit engine.
+
+bit_masks draws the 64 uniforms of a word bit-plane by bit-plane instead of one at a time: the k-th engine call supplies bit
+(63 - k) of all 64 uniforms at once, and each lane is compared against the binary expansion of bound from the most significant bit
+down. A lane is decided at the first bit where its uniform differs from bound, so half the undecided lanes drop out at every
+step and a whole word needs about log2(64) + 1.3 ~ 7.3 engine calls on average instead of 64.
+
+Several words are processed side by side with GCC vector extensions, which compile to AVX-512 or AVX2 where available.
+
+geometric_gaps draws the number of closed bonds before the next open one, floor(log(U) / log(1 - p)), which is geometrically
+distributed, and sets only the open bits: about p * num_bits + 1 engine calls per fill, a clear win for small p. Each fill starts
+afresh, which is exact as the geometric distribution is memoryless. U has 53 bits of precision, rather than the 64 of the other
+modes.
+*/
+class bond_sampler
+{
+public:
+  bond_sampler(double p, bond_sampling mode = bond_sampling::bit_masks) : _mode(mode)
+  {
+    set_probability(p);
+  }
+
+  void set_probability(double p)
+  {
+    _probability = p;
+    _bound = std::numeric_limits<uint64_t>::max() * p;
+    _log_complement = std::log1p(-p);
+  }
+
+  void set_mode(bond_sampling mode)
+  {
+    _mode = mode;
+  }
+
+  bond_sampling mode() const
+  {
+    return _mode;
+  }
+
+  // Fill the first num_bits bits of words with open bonds, clearing any bits beyond num_bits in the last word
+  template <typename engine>
+  force_inline void fill(engine& rng, uint64_t* words, size_t num_bits) const
+  {
+    const size_t num_words = (num_bits + 63) / 64;
+
+    if (_mode == bond_sampling::per_bond)
+    {
+      for (size_t bit = 0; bit < num_words * 64; ++bit)
+      {
+        if (bit % 64 == 0)
+        {
+          words[bit / 64] = 0;
+        }
+        words[bit / 64] |= static_cast<uint64_t>(bit < num_bits && rng() < _bound) << (bit % 64);
+      }
+      return;
+    }
+
+    if (_mode == bond_sampling::geometric_gaps)
+    {
+      std::fill(words, words + num_words, 0);
+      for (size_t bit = next_gap(rng, num_bits); bit < num_bits; bit += 1 + next_gap(rng, num_bits))
+      {
+        words[bit / 64] |= uint64_t(1) << (bit % 64);
+      }
+      return;
+    }
+
+    size_t word = 0;
+    for (; word + lanes <= num_words; word += lanes)
+    {
+      const lane_vector result = sample_lanes(rng);
+      for (size_t lane = 0; lane < lanes; ++lane)
+      {
+        words[word + lane] = result[lane];
+      }
+    }
+    for (; word < num_words; ++word)
+    {
+      words[word] = sample_word(rng);
+    }
+
+    if (num_bits % 64 != 0)
+    {
+      words[num_words - 1] &= (uint64_t(1) << (num_bits % 64)) - 1;
+    }
+  }
+
+private:
+#if defined(__AVX512F__)
+  static constexpr size_t lanes = 8;
+#elif defined(__AVX2__)
+  static constexpr size_t lanes = 4;
+#else
+  static constexpr size_t lanes = 2;
+#endif
+
+  typedef uint64_t lane_vector __attribute__((vector_size(8 * lanes)));
+
+  // Number of closed bonds before the next open one, capped at limit
+  template <typename engine>
+  force_inline size_t next_gap(engine& rng, size_t limit) const
+  {
+    if (_probability <= 0)
+    {
+      return limit;
+    }
+
+    const double uniform = ((rng() >> 11) + 1) * 0x1.0p-53; // In (0, 1]
+    const double gap = std::floor(std::log(uniform) / _log_complement);
+    return gap < limit ? static_cast<size_t>(gap) : limit;
+  }
+
+  template <typename engine>
+  force_inline uint64_t sample_word(engine& rng) const
+  {
+    uint64_t result = 0;
+    uint64_t undecided = ~uint64_t(0);
+
+    // Lanes still undecided after the last bit have a uniform equal to bound, so are not less than it
+    for (int bit = 63; bit >= 0 && undecided; --bit)
+    {
+      const uint64_t uniform_bits = rng();
+      if ((_bound >> bit) & 1)
+      {
+        result |= undecided & ~uniform_bits;
+        undecided &= uniform_bits;
+      }
+      else
+      {
+        undecided &= ~uniform_bits;
+      }
+    }
+
+    return result;
+  }
+
+  template <typename engine>
+  force_inline lane_vector sample_lanes(engine& rng) const
+  {
+    lane_vector result = {};
+    lane_vector undecided = ~result;
+
+    for (int bit = 63; bit >= 0; --bit)
+    {
+      lane_vector uniform_bits;
+      for (size_t lane = 0; lane < lanes; ++lane)
+      {
+        uniform_bits[lane] = rng();
+      }
+
+      // All ones if this bit of bound is set, else zero: branchless version of sample_word
+      const lane_vector bound_bit = lane_vector{} - ((_bound >> bit) & 1);
+      result |= undecided & ~uniform_bits & bound_bit;
+      undecided &= ~(uniform_bits ^ bound_bit);
+
+      uint64_t any_undecided = 0;
+      for (size_t lane = 0; lane < lanes; ++lane)
+      {
+        any_undecided |= undecided[lane];
+      }
+      if (!any_undecided)
+      {
+        break;
+      }
+    }
+
+    return result;
+  }
+
+  bond_sampling _mode;
+  double _probability;
+  uint64_t _bound;
+  double _log_complement; // log(1 - p)
+};
+
+// Call f(bit) for every set bit of the mask, in increasing order
+template <typename function>
+force_inline void for_each_set_bit(const uint64_t* words, size_t num_words, function&& f)
+{
+  for (size_t word = 0; word < num_words; ++word)
+  {
+    for (uint64_t mask = words[word]; mask; mask &= mask - 1)
+    {
+      f(64 * word + std::countr_zero(mask));
+    }
+  }
+}
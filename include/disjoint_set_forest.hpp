@@ -2,12 +2,21 @@
 
 #define force_inline inline __attribute__((always_inline))
 
+#include <atomic>
 #include <cmath>
+#include <format>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <print>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "huge_page_vector.h"
 #include "memory_mapped_vector.h"
 
 /*
@@ -19,138 +28,364 @@ Thus usage is 12 bytes per node.
 Usage was 4*3*2+8 = 32 bytes per node.
 
 Improved usage is now 8+4 = 12 bytes per node.
+
+With compact_node, a root does not need to store its own index, so the size can live in the word otherwise used for the parent:
+4 bytes per node for up to 2^30 elements, 8 bytes per node beyond that.
 */
 
-template <typename element>
-class disjoint_set_forest
+/*
+Node layouts. Every layout provides the same interface, where self is the index of the node itself in the forest:
+
+  bool is_root(size_t self) const;
+  size_t parent(size_t self) const;               // Only valid if the node is not a root
+  void set_parent(size_t parent);
+  int64_t cluster_size() const;                   // Only valid if the node is a root, negative if the cluster hits the boundary
+  void make_root(size_t self, int64_t size);
+
+max_elements is the largest forest the layout can represent.
+*/
+
+/*
+Force tight packing to ensure 12 bytes per struct, otherwise will be 16. In theory tight struct packing can cause a perfomance
+penalty when accesses cross cache lines (usually 64 bytes) in a CPU. On the other hand, tight packing can improve performance by
+reducing the number of cache misses, due to more data fitting on a cache line. In testing, tight packing here seems to improve
+performance marginally, although not enough to be certain of that. Either way the memory saving is huge.
+*/
+struct [[gnu::packed]] packed_node
 {
-public:
-  /*
-  Force tight packing to ensure 12 bytes per struct, otherwise will be 16. In theory tight struct packing can cause a perfomance
-  penalty when accesses cross cache lines (usually 64 bytes) in a CPU. On the other hand, tight packing can improve performance by
-  reducing the number of cache misses, due to more data fitting on a cache line. In testing, tight packing here seems to improve
-  performance marginally, although not enough to be certain of that. Either way the memory saving is huge.
-  */
-  struct [[gnu::packed]] node
+  static constexpr size_t max_elements = std::numeric_limits<int>::max();
+
+  force_inline bool is_root(size_t self) const
   {
-    node() : parent_index(0), size(0)
-    {
-    }
-    node(const element& e) : parent_index(get_index(e)), size(1)
-    {
-    }
-    node(const node& n) : parent_index(n.parent_index), size(n.size)
-    {
-    }
-    node& operator=(node& rhs)
-    {
-      return rhs;
-    }
+    return parent_index == self;
+  }
 
-    /*
-    Need this to be able to sort by size in a std::map
-    NOTE: second part is to ensure different clusters are distinct, as map uses < for equality comparisons.
-    */
-    bool operator<(const node& rhs) const
-    {
-      return std::abs(size) < std::abs(rhs.size) ||
-             (std::abs(size) == std::abs(rhs.size) && parent_index < rhs.parent_index); // This is eating up 20% of time
-    }
+  force_inline size_t parent(size_t) const
+  {
+    return parent_index;
+  }
 
-    size_t parent_index; // Node index is not necessary to store - get_index is used to retrieve this
-    int size;            // Number of descendants, including self
-  };
+  force_inline void set_parent(size_t parent)
+  {
+    parent_index = parent;
+  }
 
-  disjoint_set_forest(size_t num_elements) : _num_elements(num_elements)
+  force_inline int64_t cluster_size() const
   {
-    _forest.resize(num_elements);
+    return size;
   }
 
-  virtual size_t get_index(const element& node) const = 0; // Must map elements to a unique index in the range [0, num_elements)
-  virtual element get_element(size_t index) const = 0;     // Inverse map of the above map
+  force_inline void make_root(size_t self, int64_t new_size)
+  {
+    parent_index = self;
+    size = new_size;
+  }
 
-  virtual bool on_boundary(const element& node) const = 0;
+  size_t parent_index; // Node index is not necessary to store - get_index is used to retrieve this
+  int size;            // Number of descendants, including self
+};
+
+/*
+Single word node. The top bit marks a root: a root stores (size - 1) << 1 | on_boundary in the remaining bits, any other node
+stores the index of its parent. Root sizes need one bit fewer than indices, hence max_elements is 2^30 for 32 bit words.
+*/
+template <typename word>
+struct compact_node
+{
+  static_assert(std::is_unsigned_v<word>, "compact_node needs an unsigned word");
+
+  static constexpr word root_flag = word(1) << (8 * sizeof(word) - 1);
+  static constexpr size_t max_elements = size_t(1) << (8 * sizeof(word) - 2);
+
+  force_inline bool is_root(size_t) const
+  {
+    return value & root_flag;
+  }
+
+  force_inline size_t parent(size_t) const
+  {
+    return value;
+  }
+
+  force_inline void set_parent(size_t parent)
+  {
+    value = parent;
+  }
+
+  force_inline int64_t cluster_size() const
+  {
+    const int64_t size = static_cast<int64_t>((value & ~root_flag) >> 1) + 1;
+    return (value & 1) ? -size : size;
+  }
+
+  force_inline void make_root(size_t, int64_t size)
+  {
+    value = root_flag | (static_cast<word>(std::abs(size) - 1) << 1) | (size < 0);
+  }
+
+  word value;
+};
+
+template <typename node_type>
+constexpr bool is_compact_node = false;
+
+template <typename word>
+constexpr bool is_compact_node<compact_node<word>> = true;
+
+// Smallest node layout able to hold a forest of num_elements
+template <uint64_t num_elements>
+using compact_node_for =
+    std::conditional_t<num_elements <= compact_node<uint32_t>::max_elements, compact_node<uint32_t>, compact_node<uint64_t>>;
+
+/*
+The lattice supplies the mapping between elements and indices through static polymorphism (CRTP): it derives from
+basic_disjoint_set_forest<lattice, element, node_type> and provides
+
+  size_t get_index(const element& node) const;   // Must map elements to a unique index in the range [0, num_elements)
+  element get_element(size_t index) const;      // Inverse map of the above map
+  bool on_boundary(const element& node) const;
+
+as ordinary (ideally force_inline) member functions. These are resolved at compile time, so make_set and merge can be fully
+inlined into the generation loop instead of going through a vtable for every site.
+*/
+template <typename lattice, typename element, typename node_type = packed_node>
+class basic_disjoint_set_forest
+{
+public:
+  using node = node_type;
+
+  // pages selects the pages backing the forest, see huge_page_vector.h
+  basic_disjoint_set_forest(size_t num_elements, page_policy pages = page_policy::normal)
+      : _forest(check_size(num_elements), pages), _num_elements(num_elements)
+  {
+  }
+
+  // Pages actually backing the forest
+  std::string forest_pages() const
+  {
+    return _forest.describe();
+  }
 
   // IMPORTANT: element must not be in the forest.
   force_inline void make_set(const element& e)
   {
-    node& n = _forest[get_index(e)];
-    n.size = 1 - 2 * on_boundary(e); // Negative size implies cluster hits boundary
-    n.parent_index = get_index(e);
+    const size_t index = derived().get_index(e);
+    _forest[index].make_root(index, 1 - 2 * derived().on_boundary(e)); // Negative size implies cluster hits boundary
   }
 
   // Element must be in forest
   force_inline element find(const element& e)
   {
-    node& n = _forest[get_index(e)];
+    return derived().get_element(find_root(derived().get_index(e)));
+  }
 
-    return get_element(get_index(n));
+  force_inline void merge(const element& e1, const element& e2)
+  {
+    merge_indices(derived().get_index(e1), derived().get_index(e2));
   }
 
-  force_inline virtual void merge(const element& e1, const element& e2)
+  /*
+  Thread safe merge, for compact nodes only: any number of threads may call merge_concurrent at the same time, as long as every
+  element involved has been made a set beforehand and nothing else touches the forest meanwhile.
+
+  A root is linked with a single CAS of its word, and only ever under a root of higher priority, a fixed pseudo-random order on
+  indices, so parents always have higher priority than their children and no cycle can form whatever the interleaving.
+  The size and boundary flag of the linked root are then added to whichever node is the root of the merged cluster at that moment,
+  again by CAS. Should that root be linked elsewhere first, its CAS fails and the addition is retried at the new root, while a
+  thread linking it carries any addition that landed before its own CAS. Either way, once all threads are done every root holds
+  the correct signed size.
+  */
+  force_inline void merge_concurrent(const element& e1, const element& e2)
+    requires is_compact_node<node_type>
   {
-    node* n1 = &_forest[get_index(e1)];
-    node* n2 = &_forest[get_index(e2)];
+    size_t index1 = derived().get_index(e1);
+    size_t index2 = derived().get_index(e2);
+
+    while (true)
+    {
+      size_t root1 = find_root_concurrent(index1);
+      size_t root2 = find_root_concurrent(index2);
 
-    n1 = find(n1);
-    n2 = find(n2);
+      if (root1 == root2)
+      {
+        return;
+      }
+      if (priority(root1) > priority(root2))
+      {
+        std::swap(root1, root2);
+      }
+
+      // Link root1 under root2, unless root1 stopped being a root since it was found
+      auto word1 = std::atomic_ref(_forest[root1].value).load(std::memory_order_acquire);
+      if ((word1 & node::root_flag) && std::atomic_ref(_forest[root1].value).compare_exchange_weak(word1, root2, std::memory_order_acq_rel))
+      {
+        add_to_root_concurrent(root2, word1);
+        return;
+      }
+
+      index1 = root1;
+      index2 = root2;
+    }
+  }
 
-    if (n1 == n2)
+protected:
+  static size_t check_size(size_t num_elements)
+  {
+    if (num_elements > node::max_elements)
+    {
+      throw std::length_error(std::format("Node layout cannot hold {} elements", num_elements));
+    }
+    return num_elements;
+  }
+
+  force_inline lattice& derived()
+  {
+    return static_cast<lattice&>(*this);
+  }
+
+  force_inline const lattice& derived() const
+  {
+    return static_cast<const lattice&>(*this);
+  }
+
+  // Merge the clusters of the nodes with the given indices, by size
+  force_inline void merge_indices(size_t index1, size_t index2)
+  {
+    const size_t root1 = find_root(index1);
+    const size_t root2 = find_root(index2);
+
+    if (root1 == root2)
     {
       return;
     }
 
-    if (std::abs(n1->size) < std::abs(n2->size))
+    const int64_t size1 = _forest[root1].cluster_size();
+    const int64_t size2 = _forest[root2].cluster_size();
+
+    // Branchless way to add sizes and set result as negative if either cluster hits the boundary (i.e. has negative size)
+    const int64_t size = (std::abs(size1) + std::abs(size2)) * (1 - 2 * (size1 < 0 || size2 < 0));
+
+    if (std::abs(size1) < std::abs(size2))
     {
-      n1->parent_index = get_index(n2);
-      // n2->size = n2->size * (1 - 2 * (n2->size > 0 && n1->size < 0)) + n1->size * (1 - 2 * (n1->size > 0 && n2->size < 0));
-      // Branchless way to add sizes and set result as negative if either cluster hits the boundary (i.e. has negative size)
-      n2->size = (std::abs(n1->size) + std::abs(n2->size)) * (1 - 2 * (n1->size < 0 || n2->size < 0));
+      _forest[root1].set_parent(root2);
+      _forest[root2].make_root(root2, size);
     }
     else
     {
-      n2->parent_index = get_index(n1);
-      n1->size = (std::abs(n1->size) + std::abs(n2->size)) * (1 - 2 * (n1->size < 0 || n2->size < 0));
+      _forest[root2].set_parent(root1);
+      _forest[root1].make_root(root1, size);
     }
   }
 
-protected:
   // Find root with path halving
-  force_inline node* find(node* n)
+  force_inline size_t find_root(size_t index)
   {
-    while (n->parent_index != get_index(n))
+    while (!_forest[index].is_root(index))
     {
-      n->parent_index = _forest[n->parent_index].parent_index;
-      n = &_forest[n->parent_index];
+      const size_t parent = _forest[index].parent(index);
+      if (_forest[parent].is_root(parent))
+      {
+        return parent;
+      }
+
+      const size_t grandparent = _forest[parent].parent(parent);
+      _forest[index].set_parent(grandparent);
+      index = grandparent;
     }
-    return n;
+    return index;
   }
 
-  // Find root without modifying path
-  force_inline const node* find_const(const node* n) const
+  // Find root with path splitting, safe against concurrent merge_concurrent calls: each step is a single CAS which may fail
+  force_inline size_t find_root_concurrent(size_t index)
+    requires is_compact_node<node_type>
   {
-    while (n->parent_index != get_index(n))
+    while (true)
     {
-      n = &_forest[n->parent_index];
+      auto word = std::atomic_ref(_forest[index].value).load(std::memory_order_acquire);
+      if (word & node::root_flag)
+      {
+        return index;
+      }
+
+      const size_t parent = word;
+      const auto parent_word = std::atomic_ref(_forest[parent].value).load(std::memory_order_acquire);
+      if (parent_word & node::root_flag)
+      {
+        return parent;
+      }
+
+      std::atomic_ref(_forest[index].value).compare_exchange_weak(word, parent_word, std::memory_order_relaxed);
+      index = parent;
     }
-    return n;
   }
 
-  force_inline node* get_node(const element& e)
+  // Add the size and boundary flag held in root_word, the word of a root just linked, to the root of the cluster of index
+  force_inline void add_to_root_concurrent(size_t index, uint64_t root_word)
+    requires is_compact_node<node_type>
   {
-    return &_forest[get_index(e)];
+    const uint64_t increment = ((root_word & ~uint64_t(node::root_flag)) >> 1) + 1;
+
+    while (true)
+    {
+      const size_t root = find_root_concurrent(index);
+      auto word = std::atomic_ref(_forest[root].value).load(std::memory_order_acquire);
+      if ((word & node::root_flag) &&
+          std::atomic_ref(_forest[root].value).compare_exchange_weak(word, (word + (increment << 1)) | (root_word & 1), std::memory_order_acq_rel))
+      {
+        return;
+      }
+      index = root;
+    }
+  }
+
+  // Bijective mix of the index, so that linking by priority behaves like linking by random rank
+  static force_inline uint64_t priority(size_t index)
+  {
+    return index * 0x9e3779b97f4a7c15;
+  }
+
+  // Find root without modifying path
+  force_inline size_t find_root_const(size_t index) const
+  {
+    while (!_forest[index].is_root(index))
+    {
+      index = _forest[index].parent(index);
+    }
+    return index;
   }
 
-  force_inline size_t get_index(const node* n) const
+  // Signed size of the cluster with the given root
+  force_inline int64_t cluster_size(size_t root) const
   {
-    return n - &_forest[0];
+    return _forest[root].cluster_size();
   }
 
-  std::vector<node> _forest;
+  huge_page_vector<node> _forest;
   size_t _num_elements;
 };
 
+/*
+Thin adapter keeping the original runtime-polymorphic interface: the lattice overrides the mappings as virtual functions.
+Convenient for quick experiments, but every make_set/merge pays for an indirect call, so simulations should derive from
+basic_disjoint_set_forest directly.
+*/
+template <typename element>
+class disjoint_set_forest : public basic_disjoint_set_forest<disjoint_set_forest<element>, element>
+{
+public:
+  disjoint_set_forest(size_t num_elements) : basic_disjoint_set_forest<disjoint_set_forest<element>, element>(num_elements)
+  {
+  }
+
+  virtual ~disjoint_set_forest() = default;
+
+  virtual size_t get_index(const element& node) const = 0; // Must map elements to a unique index in the range [0, num_elements)
+  virtual element get_element(size_t index) const = 0;     // Inverse map of the above map
+
+  virtual bool on_boundary(const element& node) const = 0;
+};
+
 /*
 Problem with references approach: inplace_vector might work, but cannot be resized.
 Resizing would lead to invalidating all references.
-*/
\ No newline at end of file
+*/
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <print>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+#include <sys/mman.h>
+
+// Pages backing a huge_page_vector, largest last
+enum class page_policy
+{
+  normal,      // 4 KiB pages
+  transparent, // madvise(MADV_HUGEPAGE): 2 MiB pages where the kernel can find them, see /sys/kernel/mm/transparent_hugepage
+  huge_2m,     // MAP_HUGETLB from the pool reserved in /sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages
+  huge_1g,     // MAP_HUGETLB from the pool reserved in /sys/kernel/mm/hugepages/hugepages-1048576kB/nr_hugepages
+};
+
+/*
+Fixed size vector of trivially copyable T in anonymous memory mapped with the given page policy. With 4 KiB pages, random access to a
+forest of several GiB misses the TLB on nearly every lookup; a 2 MiB page covers 512 times as much, and a 1 GiB page the whole
+forest at cube_pow = 8.
+If the pages asked for cannot be had (no reserved pool, or transparent huge pages disabled), each smaller policy is tried in turn,
+so the vector always works; policy() and describe() tell what it actually got.
+
+Elements start zeroed, by the kernel on first touch rather than by the constructing thread.
+*/
+template <typename T>
+class huge_page_vector
+{
+public:
+  explicit huge_page_vector(size_t size, page_policy requested = page_policy::normal) : _size(size)
+  {
+    for (page_policy policy = requested;; policy = static_cast<page_policy>(static_cast<int>(policy) - 1))
+    {
+      if (try_map(policy))
+      {
+        break;
+      }
+      if (policy == page_policy::normal)
+      {
+        throw std::runtime_error(std::format("Failed to map {} bytes: {}", _size * sizeof(T), std::strerror(errno)));
+      }
+    }
+
+    if (_policy != requested)
+    {
+      std::println("Could not get {} pages, using {} pages", name(requested), name(_policy));
+    }
+  }
+
+  ~huge_page_vector()
+  {
+    munmap(_data, _bytes);
+  }
+
+  huge_page_vector(const huge_page_vector&) = delete;
+  huge_page_vector& operator=(const huge_page_vector&) = delete;
+
+  T* data() noexcept
+  {
+    return _data;
+  }
+
+  const T* data() const noexcept
+  {
+    return _data;
+  }
+
+  T& operator[](size_t n) noexcept
+  {
+    return *(_data + n);
+  }
+
+  const T& operator[](size_t n) const noexcept
+  {
+    return *(_data + n);
+  }
+
+  size_t size() const noexcept
+  {
+    return _size;
+  }
+
+  page_policy policy() const noexcept
+  {
+    return _policy;
+  }
+
+  // The pages obtained, and for transparent huge pages how much of the vector the kernel has backed by them so far
+  std::string describe() const
+  {
+    if (_policy != page_policy::transparent)
+    {
+      return std::format("{} pages", name(_policy));
+    }
+    return std::format("transparent huge pages, {} of {} MiB in 2 MiB pages", transparent_huge_bytes() >> 20, _bytes >> 20);
+  }
+
+  static std::string_view name(page_policy policy)
+  {
+    static constexpr std::array<std::string_view, 4> names = {"4 KiB", "transparent 2 MiB", "2 MiB", "1 GiB"};
+    return names[static_cast<size_t>(policy)];
+  }
+
+private:
+  static constexpr std::array<size_t, 4> _page_bytes = {size_t(4) << 10, size_t(2) << 20, size_t(2) << 20, size_t(1) << 30};
+
+  bool try_map(page_policy policy)
+  {
+    const size_t page_bytes = _page_bytes[static_cast<size_t>(policy)];
+    _bytes = (std::max<size_t>(_size * sizeof(T), 1) + page_bytes - 1) / page_bytes * page_bytes;
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (policy == page_policy::huge_2m)
+    {
+      flags |= MAP_HUGETLB | (21 << MAP_HUGE_SHIFT);
+    }
+    else if (policy == page_policy::huge_1g)
+    {
+      flags |= MAP_HUGETLB | (30 << MAP_HUGE_SHIFT);
+    }
+
+    void* data = mmap(nullptr, _bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (data == MAP_FAILED)
+    {
+      return false;
+    }
+
+    if (policy == page_policy::transparent && madvise(data, _bytes, MADV_HUGEPAGE) != 0)
+    {
+      munmap(data, _bytes);
+      return false;
+    }
+
+    _data = static_cast<T*>(data);
+    _policy = policy;
+    return true;
+  }
+
+  // AnonHugePages of the mapping in /proc/self/smaps
+  size_t transparent_huge_bytes() const
+  {
+    std::ifstream smaps("/proc/self/smaps");
+    bool in_mapping = false;
+    for (std::string line; std::getline(smaps, line);)
+    {
+      const std::string_view first_field = std::string_view(line).substr(0, line.find(' '));
+      if (first_field.find('-') != std::string_view::npos)
+      {
+        // Header of a mapping: start-end perms offset device inode path
+        in_mapping = std::stoull(line, nullptr, 16) == reinterpret_cast<uintptr_t>(_data);
+      }
+      else if (in_mapping && first_field == "AnonHugePages:")
+      {
+        return std::stoull(line.substr(first_field.size())) << 10;
+      }
+    }
+    return 0;
+  }
+
+  T* _data;
+  size_t _size;
+  size_t _bytes;
+  page_policy _policy;
+};
@@ -1,33 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <format>
+#include <print>
 #include <stdexcept>
 #include <string>
+#include <utility>
 
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+/*
+Vector of trivially copyable T backed by an unnamed temporary file. The mapping is shared, so pages written and then dropped with
+advise(..., MADV_DONTNEED) are written back to the file rather than to swap, and the vector can be far larger than physical memory
+as long as it is accessed in large sequential runs.
+*/
 template <typename T>
 class memory_mapped_vector
 {
 public:
-  memory_mapped_vector() : _size(_page_size) // TODO: this could be unnecessarily large depending on T
+  memory_mapped_vector() : memory_mapped_vector(_page_size) // TODO: this could be unnecessarily large depending on T
+  {
+  }
+
+  // The file is created in directory, which should be on a disk with room for size elements
+  memory_mapped_vector(size_t size, const std::string& directory = "/tmp/") : _size(size)
   {
-    _fd = open("/tmp/", O_RDWR | O_TMPFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+    _fd = open(directory.c_str(), O_RDWR | O_TMPFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
     if (_fd == -1)
     {
-      throw std::runtime_error("Failed to create temporary file");
+      throw std::runtime_error(std::format("Failed to create temporary file in {}: {}", directory, std::strerror(errno)));
     }
 
     if (ftruncate(_fd, _size * sizeof(T)) == -1)
     {
+      close(_fd);
       throw std::runtime_error("Failed resize temporary file");
     }
 
-    _data = static_cast<T*>(mmap(nullptr, _size * sizeof(T), PROT_READ | PROT_WRITE, MAP_PRIVATE, _fd, 0));
+    _data = static_cast<T*>(mmap(nullptr, _size * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0));
     if (_data == MAP_FAILED)
     {
-      throw std::runtime_error(std::format("Failed to map file: ", std::strerror(errno)));
+      close(_fd);
+      throw std::runtime_error(std::format("Failed to map file: {}", std::strerror(errno)));
     }
   }
 
@@ -35,13 +53,15 @@ public:
   {
     if (munmap((void*)_data, _size * sizeof(T)) == -1)
     {
-      close(_fd);
       std::println("Failed to unmap temporary file");
     }
 
     close(_fd);
   }
 
+  memory_mapped_vector(const memory_mapped_vector&) = delete;
+  memory_mapped_vector& operator=(const memory_mapped_vector&) = delete;
+
   void resize(size_t new_size)
   {
     if (new_size > _size)
@@ -62,6 +82,30 @@ public:
     }
   }
 
+  // madvise the pages covering elements [first, first + count), e.g. MADV_SEQUENTIAL before a scan and MADV_DONTNEED after it
+  void advise(size_t first, size_t count, int advice) const
+  {
+    auto [start, length] = page_range(first, count);
+    madvise(start, length, advice);
+  }
+
+  // Start writing back the pages covering elements [first, first + count), without waiting for the disk
+  void flush(size_t first, size_t count) const
+  {
+    auto [start, length] = page_range(first, count);
+    msync(start, length, MS_ASYNC);
+  }
+
+  T* data() noexcept
+  {
+    return _data;
+  }
+
+  const T* data() const noexcept
+  {
+    return _data;
+  }
+
   T& operator[](size_t n) noexcept
   {
     return *(_data + n);
@@ -78,6 +122,14 @@ public:
   }
 
 private:
+  // Page aligned range containing elements [first, first + count)
+  std::pair<void*, size_t> page_range(size_t first, size_t count) const
+  {
+    const size_t begin = (first * sizeof(T)) / _page_size * _page_size;
+    const size_t end = std::min(((first + count) * sizeof(T) + _page_size - 1) / _page_size * _page_size, _size * sizeof(T));
+    return {reinterpret_cast<char*>(_data) + begin, end - begin};
+  }
+
   T* _data;
   size_t _size;
 
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <print>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// How thread_pool places its threads on cores
+enum class thread_affinity
+{
+  none,    // Wherever the scheduler likes
+  compact, // Thread t on the t-th core, filling one NUMA node before the next
+  scatter, // Thread t on NUMA node t % num_nodes, spreading threads (and so memory bandwidth) over the nodes
+};
+
+/*
+Cores of each NUMA node, from /sys/devices/system/node, restricted to those the process may run on (sched_getaffinity, so a cgroup
+cpuset or taskset is respected). On a machine without NUMA (or without sysfs) every core is on node 0.
+*/
+class numa_topology
+{
+public:
+  numa_topology()
+  {
+    const std::filesystem::path nodes_path = "/sys/devices/system/node";
+    for (int node = 0; std::filesystem::exists(nodes_path / ("node" + std::to_string(node))); ++node)
+    {
+      std::ifstream cpulist(nodes_path / ("node" + std::to_string(node)) / "cpulist");
+      std::string list;
+      std::getline(cpulist, list);
+      _node_cpus.push_back(parse_cpu_list(list));
+    }
+
+    if (_node_cpus.empty())
+    {
+      _node_cpus.emplace_back();
+      for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu)
+      {
+        _node_cpus.back().push_back(cpu);
+      }
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+      for (std::vector<int>& cpus : _node_cpus)
+      {
+        std::erase_if(cpus, [&](int cpu) { return cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed); });
+      }
+    }
+    std::erase_if(_node_cpus, [](const std::vector<int>& cpus) { return cpus.empty(); }); // Memory-only nodes, or none allowed
+
+    if (_node_cpus.empty())
+    {
+      _node_cpus.push_back({0}); // Pinning then fails and is reported, rather than indexing nothing
+    }
+  }
+
+  size_t num_nodes() const
+  {
+    return _node_cpus.size();
+  }
+
+  // Cores the process may run on, over all nodes
+  size_t num_cpus() const
+  {
+    size_t count = 0;
+    for (const std::vector<int>& cpus : _node_cpus)
+    {
+      count += cpus.size();
+    }
+    return count;
+  }
+
+  // Core for thread index of num_threads under the given policy, or -1 for no pinning. Threads share cores beyond num_cpus.
+  int cpu_for_thread(thread_affinity affinity, size_t index) const
+  {
+    switch (affinity)
+    {
+    case thread_affinity::none:
+      return -1;
+    case thread_affinity::compact:
+    {
+      size_t position = index % num_cpus();
+      for (const std::vector<int>& cpus : _node_cpus)
+      {
+        if (position < cpus.size())
+        {
+          return cpus[position];
+        }
+        position -= cpus.size();
+      }
+      return -1;
+    }
+    case thread_affinity::scatter:
+    {
+      const std::vector<int>& cpus = _node_cpus[index % num_nodes()];
+      return cpus[(index / num_nodes()) % cpus.size()];
+    }
+    }
+    return -1;
+  }
+
+  // Pin thread to cpu, reporting a failure on stderr and in pin_failures
+  static bool pin_thread(pthread_t thread, int cpu)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+
+    const int result = pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+    if (result != 0)
+    {
+      _pin_failures.fetch_add(1, std::memory_order_relaxed);
+      std::println(stderr, "Failed to pin thread to CPU {}: {}", cpu, std::strerror(result));
+    }
+    return result == 0;
+  }
+
+  // Number of failed calls to pin_thread so far in the process
+  static uint64_t pin_failures()
+  {
+    return _pin_failures.load(std::memory_order_relaxed);
+  }
+
+private:
+  inline static std::atomic<uint64_t> _pin_failures = 0;
+
+  // e.g. "0-15,32-47"
+  static std::vector<int> parse_cpu_list(const std::string& list)
+  {
+    std::vector<int> cpus;
+    size_t position = 0;
+    while (position < list.size())
+    {
+      size_t end = list.find(',', position);
+      if (end == std::string::npos)
+      {
+        end = list.size();
+      }
+
+      const std::string range = list.substr(position, end - position);
+      const size_t dash = range.find('-');
+      const int first = std::stoi(range);
+      const int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu)
+      {
+        cpus.push_back(cpu);
+      }
+
+      position = end + 1;
+    }
+    return cpus;
+  }
+
+  std::vector<std::vector<int>> _node_cpus;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <initializer_list>
+#include <optional>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum class perf_event
+{
+  cycles,
+  instructions,
+  llc_misses,
+  dtlb_misses,
+  branch_misses,
+  node_loads,       // Loads served by memory on any NUMA node
+  node_load_misses, // Of which from memory on a remote node
+};
+
+/*
+Hardware counters via perf_event_open, counting user space events of the calling thread and, with inherit, of any thread it creates
+while the counters are open: read then adds in the counts of those threads, whether still running or exited, so std::thread workers
+spawned inside a measured region are included. Counters meant for the calling thread alone need inherit = false.
+Each event is opened on its own, so if the kernel refuses one (perf_event_paranoid, or a VM without the event in its PMU) only
+that counter is missing and read returns std::nullopt for it.
+*/
+class perf_counters
+{
+public:
+  perf_counters(std::initializer_list<perf_event> events, bool inherit = true) : _events(events)
+  {
+    for (perf_event event : _events)
+    {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.disabled = 1;
+      attr.inherit = inherit;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      set_event(attr, event);
+
+      _fds.push_back(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+  }
+
+  ~perf_counters()
+  {
+    for (int fd : _fds)
+    {
+      if (fd != -1)
+      {
+        close(fd);
+      }
+    }
+  }
+
+  perf_counters(const perf_counters&) = delete;
+  perf_counters& operator=(const perf_counters&) = delete;
+
+  inline void start()
+  {
+    for (int fd : _fds)
+    {
+      if (fd != -1)
+      {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+      }
+    }
+  }
+
+  inline void stop()
+  {
+    for (int fd : _fds)
+    {
+      if (fd != -1)
+      {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      }
+    }
+  }
+
+  // Counts since the last start, in the order the events were given
+  std::vector<std::optional<uint64_t>> read() const
+  {
+    std::vector<std::optional<uint64_t>> values;
+    for (int fd : _fds)
+    {
+      uint64_t value;
+      if (fd != -1 && ::read(fd, &value, sizeof(value)) == sizeof(value))
+      {
+        values.push_back(value);
+      }
+      else
+      {
+        values.push_back(std::nullopt);
+      }
+    }
+    return values;
+  }
+
+  const std::vector<perf_event>& events() const
+  {
+    return _events;
+  }
+
+  static std::string_view name(perf_event event)
+  {
+    static constexpr std::array<std::string_view, 7> names = {"cycles",        "instructions", "llc_misses",      "dtlb_misses",
+                                                              "branch_misses", "node_loads",   "node_load_misses"};
+    return names[static_cast<size_t>(event)];
+  }
+
+private:
+  static void set_event(perf_event_attr& attr, perf_event event)
+  {
+    switch (event)
+    {
+    case perf_event::cycles:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case perf_event::instructions:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case perf_event::llc_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case perf_event::dtlb_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case perf_event::branch_misses:
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+    case perf_event::node_loads:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16);
+      break;
+    case perf_event::node_load_misses:
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.config = PERF_COUNT_HW_CACHE_NODE | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    }
+  }
+
+  std::vector<perf_event> _events;
+  std::vector<int> _fds;
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <filesystem>
+#include <stdint.h>
+
+/*
+Per-phase instrumentation of a simulation, compiled in with -Dprofile_phases=true (defining PERCOLATION_PROFILE_PHASES). A
+scoped_phase measures the wall time and hardware counters of the calling thread from its construction to its destruction, and
+writes them as a line of CSV to phase_profile.csv (or the file given to phase_profiler::open):
+
+  simulation,phase,level,thread,start_ns,wall_ns,cycles,llc_misses,dtlb_misses,branch_misses
+
+where level is the level in the merge tree of the slabs for merge phases, thread numbers the threads in order of their first phase,
+and counters the kernel refuses are left empty. Phases should not wait on the thread pool, since a waiting thread runs other tasks.
+
+Without the flag scoped_phase is empty and compiles away.
+*/
+enum class phase
+{
+  generate_slab,
+  merge_find, // Looking up the roots of the bonds between two slabs, per tile
+  merge_union, // Merging the distinct root pairs, serially
+  count_clusters,
+};
+
+#ifdef PERCOLATION_PROFILE_PHASES
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <format>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "perf_counters.h"
+
+class phase_profiler
+{
+public:
+  static phase_profiler& instance()
+  {
+    static phase_profiler profiler;
+    return profiler;
+  }
+
+  void open(const std::filesystem::path& path)
+  {
+    std::lock_guard lock(_mutex);
+    open_output(path);
+  }
+
+  // Simulation the following phases belong to
+  void set_simulation(uint64_t simulation)
+  {
+    _simulation.store(simulation, std::memory_order_relaxed);
+  }
+
+  /*
+  Counters of the calling thread, opened on its first phase and left running. Not inherited: threads it creates later (a rebuilt
+  pool, replicas) have counters of their own, and must not add into these.
+  */
+  perf_counters& thread_counters()
+  {
+    thread_local perf_counters counters({perf_event::cycles, perf_event::llc_misses, perf_event::dtlb_misses, perf_event::branch_misses}, false);
+    [[maybe_unused]] thread_local const bool started = (counters.start(), true);
+    return counters;
+  }
+
+  uint32_t thread_number()
+  {
+    thread_local const uint32_t number = _num_threads.fetch_add(1, std::memory_order_relaxed);
+    return number;
+  }
+
+  uint64_t now_ns() const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _epoch).count();
+  }
+
+  void record(phase current_phase, int level, uint64_t start_ns, uint64_t end_ns, const std::vector<std::optional<uint64_t>>& start_counts,
+              const std::vector<std::optional<uint64_t>>& end_counts)
+  {
+    static constexpr std::array<std::string_view, 4> names = {"generate_slab", "merge_find", "merge_union", "count_clusters"};
+
+    std::string line = std::format("{},{},{},{},{},{}", _simulation.load(std::memory_order_relaxed), names[static_cast<size_t>(current_phase)],
+                                   level, thread_number(), start_ns, end_ns - start_ns);
+    for (size_t event = 0; event < start_counts.size(); ++event)
+    {
+      line += start_counts[event] && end_counts[event] ? std::format(",{}", *end_counts[event] - *start_counts[event]) : ",";
+    }
+    line += '\n';
+
+    std::lock_guard lock(_mutex);
+    if (!_output.is_open())
+    {
+      open_output("phase_profile.csv");
+    }
+    _output << line;
+  }
+
+private:
+  phase_profiler() : _epoch(std::chrono::steady_clock::now())
+  {
+  }
+
+  void open_output(const std::filesystem::path& path)
+  {
+    _output = std::ofstream(path);
+    _output << "simulation,phase,level,thread,start_ns,wall_ns,cycles,llc_misses,dtlb_misses,branch_misses\n";
+  }
+
+  const std::chrono::steady_clock::time_point _epoch;
+  std::atomic<uint64_t> _simulation = 0;
+  std::atomic<uint32_t> _num_threads = 0;
+
+  std::mutex _mutex;
+  std::ofstream _output;
+};
+
+class scoped_phase
+{
+public:
+  explicit scoped_phase(phase current_phase, int level = 0)
+      : _phase(current_phase), _level(level), _start_counts(phase_profiler::instance().thread_counters().read()),
+        _start_ns(phase_profiler::instance().now_ns())
+  {
+  }
+
+  ~scoped_phase()
+  {
+    phase_profiler& profiler = phase_profiler::instance();
+    const uint64_t end_ns = profiler.now_ns();
+    profiler.record(_phase, _level, _start_ns, end_ns, _start_counts, profiler.thread_counters().read());
+  }
+
+  scoped_phase(const scoped_phase&) = delete;
+  scoped_phase& operator=(const scoped_phase&) = delete;
+
+private:
+  const phase _phase;
+  const int _level;
+  const std::vector<std::optional<uint64_t>> _start_counts;
+  const uint64_t _start_ns;
+};
+
+#else
+
+class phase_profiler
+{
+public:
+  static phase_profiler& instance()
+  {
+    static phase_profiler profiler;
+    return profiler;
+  }
+
+  void open(const std::filesystem::path&)
+  {
+  }
+
+  void set_simulation(uint64_t)
+  {
+  }
+};
+
+class scoped_phase
+{
+public:
+  explicit scoped_phase(phase, int = 0)
+  {
+  }
+
+  scoped_phase(const scoped_phase&) = delete;
+  scoped_phase& operator=(const scoped_phase&) = delete;
+};
+
+#endif
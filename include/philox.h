@@ -0,0 +1,79 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <array>
+#include <limits>
+#include <stdint.h>
+
+/*
+Philox4x64-10 counter-based generator (Salmon, Moraes, Dror and Shaw, "Parallel random numbers: as easy as 1, 2, 3", 2011): a keyed
+bijection of 256 bit counters, so the n-th random block of any stream is computed directly from (key, counter) with no state to
+carry or share between threads.
+*/
+class philox4x64
+{
+public:
+  using counter = std::array<uint64_t, 4>;
+  using key = std::array<uint64_t, 2>;
+
+  static force_inline counter generate(counter block, key k)
+  {
+    for (int round = 0; round < 10; ++round)
+    {
+      if (round > 0)
+      {
+        k[0] += 0x9e3779b97f4a7c15;
+        k[1] += 0xbb67ae8584caa73b;
+      }
+
+      const unsigned __int128 product0 = static_cast<unsigned __int128>(0xd2e7470ee14c6c93) * block[0];
+      const unsigned __int128 product1 = static_cast<unsigned __int128>(0xca5a826395121157) * block[2];
+      block = {static_cast<uint64_t>(product1 >> 64) ^ block[1] ^ k[0], static_cast<uint64_t>(product1),
+               static_cast<uint64_t>(product0 >> 64) ^ block[3] ^ k[1], static_cast<uint64_t>(product0)};
+    }
+    return block;
+  }
+};
+
+/*
+Sequence of 64 bit uniforms keyed by (key, stream): the uniforms of block n are philox4x64(key, {stream[0], stream[1], stream[2], n}).
+Satisfies UniformRandomBitGenerator, so it can be handed to anything taking an engine.
+*/
+class philox_stream
+{
+public:
+  using result_type = uint64_t;
+
+  philox_stream(philox4x64::key key, uint64_t stream0, uint64_t stream1 = 0, uint64_t stream2 = 0)
+      : _key(key), _counter{stream0, stream1, stream2, 0}, _position(4)
+  {
+  }
+
+  force_inline uint64_t operator()()
+  {
+    if (_position == 4)
+    {
+      _block = philox4x64::generate(_counter, _key);
+      ++_counter[3];
+      _position = 0;
+    }
+    return _block[_position++];
+  }
+
+  static constexpr uint64_t min()
+  {
+    return 0;
+  }
+
+  static constexpr uint64_t max()
+  {
+    return std::numeric_limits<uint64_t>::max();
+  }
+
+private:
+  philox4x64::key _key;
+  philox4x64::counter _counter;
+  philox4x64::counter _block;
+  uint32_t _position;
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+
+#include "numa_topology.h"
+
+// Tasks submitted together, so that they can be waited on together. Must outlive its tasks.
+class task_group
+{
+public:
+  task_group() = default;
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+private:
+  friend class thread_pool;
+
+  std::atomic<size_t> _pending = 0;
+};
+
+/*
+Persistent work-stealing pool. Each thread has its own deque of tasks: it pushes tasks it submits to the back and pops from the back
+(so a thread keeps working on what it just split off, while it is still in cache), and when it runs dry it steals from the front of
+the other deques, where the oldest and so usually largest tasks are.
+
+A pool of num_threads threads starts num_threads - 1 workers: the thread calling wait is expected to be the last one, and runs tasks
+(from the shared deque 0 used by threads outside the pool, or stolen) until its group is done. Tasks may submit further tasks, which
+is how dependent tasks are scheduled: the last task a step depends on submits it.
+Tasks must not throw.
+
+With an affinity other than none every thread is pinned to a core, the thread constructing the pool (expected to be the one
+calling wait) as thread 0 until the pool is destroyed. submit_to then puts a task on the deque of a given thread, so that work on
+the same data, e.g. the same slab of the forest in every simulation, keeps going to the same core and NUMA node unless stolen.
+*/
+class thread_pool
+{
+public:
+  explicit thread_pool(size_t num_threads, thread_affinity affinity = thread_affinity::none) : _affinity(affinity)
+  {
+    num_threads = std::max<size_t>(num_threads, 1);
+    for (size_t index = 0; index < num_threads; ++index)
+    {
+      _queues.push_back(std::make_unique<queue>());
+    }
+
+    if (_affinity != thread_affinity::none)
+    {
+      pthread_getaffinity_np(pthread_self(), sizeof(_owner_cpus), &_owner_cpus);
+      numa_topology::pin_thread(pthread_self(), _topology.cpu_for_thread(_affinity, 0));
+    }
+
+    for (size_t index = 1; index < num_threads; ++index)
+    {
+      _threads.emplace_back(&thread_pool::worker, this, index);
+    }
+  }
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard lock(_sleep_mutex);
+      _stop = true;
+    }
+    _wake.notify_all();
+
+    for (std::thread& thread : _threads)
+    {
+      thread.join();
+    }
+
+    if (_affinity != thread_affinity::none)
+    {
+      pthread_setaffinity_np(pthread_self(), sizeof(_owner_cpus), &_owner_cpus);
+    }
+  }
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  size_t num_threads() const
+  {
+    return _queues.size();
+  }
+
+  thread_affinity affinity() const
+  {
+    return _affinity;
+  }
+
+  template <typename function>
+  void submit(task_group& group, function&& f)
+  {
+    push(current_index(), group, std::forward<function>(f));
+    _wake.notify_one();
+  }
+
+  // Queue f for thread index (0 being the thread calling wait), waking every thread so that index is among them
+  template <typename function>
+  void submit_to(size_t index, task_group& group, function&& f)
+  {
+    push(index % _queues.size(), group, std::forward<function>(f));
+    _wake.notify_all();
+  }
+
+  // Run tasks until every task of the group, including any submitted while waiting, has finished
+  void wait(task_group& group)
+  {
+    const size_t index = current_index();
+    while (group._pending.load(std::memory_order_acquire) > 0)
+    {
+      if (!try_run_task(index))
+      {
+        std::unique_lock lock(_sleep_mutex);
+        _wake.wait(lock, [&]() { return group._pending.load(std::memory_order_acquire) == 0 || _queued.load(std::memory_order_acquire) > 0; });
+      }
+    }
+  }
+
+private:
+  template <typename function>
+  void push(size_t index, task_group& group, function&& f)
+  {
+    group._pending.fetch_add(1, std::memory_order_relaxed);
+    {
+      queue& target_queue = *_queues[index];
+      std::lock_guard lock(target_queue.mutex);
+      target_queue.tasks.push_back({std::forward<function>(f), &group});
+    }
+
+    // Taking the lock orders the increment before any sleeping thread's check, so the wake up cannot be lost
+    _queued.fetch_add(1, std::memory_order_release);
+    {
+      std::lock_guard lock(_sleep_mutex);
+    }
+  }
+
+  struct task
+  {
+    std::function<void()> function;
+    task_group* group;
+  };
+
+  struct alignas(64) queue
+  {
+    std::mutex mutex;
+    std::deque<task> tasks;
+  };
+
+  // Index of the calling thread's deque, 0 for threads outside the pool
+  size_t current_index() const
+  {
+    return _current_pool == this ? _current_index : 0;
+  }
+
+  bool try_run_task(size_t index)
+  {
+    task current;
+    if (!pop_task(index, current))
+    {
+      return false;
+    }
+    _queued.fetch_sub(1, std::memory_order_relaxed);
+
+    current.function();
+
+    if (current.group->_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      {
+        std::lock_guard lock(_sleep_mutex);
+      }
+      _wake.notify_all();
+    }
+    return true;
+  }
+
+  // Own deque from the back, then steal from the front of the others
+  bool pop_task(size_t index, task& result)
+  {
+    {
+      queue& own_queue = *_queues[index];
+      std::lock_guard lock(own_queue.mutex);
+      if (!own_queue.tasks.empty())
+      {
+        result = std::move(own_queue.tasks.back());
+        own_queue.tasks.pop_back();
+        return true;
+      }
+    }
+
+    for (size_t offset = 1; offset < _queues.size(); ++offset)
+    {
+      queue& other_queue = *_queues[(index + offset) % _queues.size()];
+      std::lock_guard lock(other_queue.mutex);
+      if (!other_queue.tasks.empty())
+      {
+        result = std::move(other_queue.tasks.front());
+        other_queue.tasks.pop_front();
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void worker(size_t index)
+  {
+    _current_pool = this;
+    _current_index = index;
+    if (_affinity != thread_affinity::none)
+    {
+      numa_topology::pin_thread(pthread_self(), _topology.cpu_for_thread(_affinity, index));
+    }
+
+    while (true)
+    {
+      if (!try_run_task(index))
+      {
+        std::unique_lock lock(_sleep_mutex);
+        _wake.wait(lock, [&]() { return _stop || _queued.load(std::memory_order_acquire) > 0; });
+        if (_stop && _queued.load(std::memory_order_acquire) == 0)
+        {
+          return;
+        }
+      }
+    }
+  }
+
+  const thread_affinity _affinity;
+  const numa_topology _topology;
+  cpu_set_t _owner_cpus; // Affinity of the constructing thread before it was pinned
+
+  std::vector<std::unique_ptr<queue>> _queues;
+  std::vector<std::thread> _threads;
+
+  std::atomic<size_t> _queued = 0; // Tasks sitting in any deque
+  std::mutex _sleep_mutex;
+  std::condition_variable _wake;
+  bool _stop = false;
+
+  inline static thread_local const thread_pool* _current_pool = nullptr;
+  inline static thread_local size_t _current_index = 0;
+};
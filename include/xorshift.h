@@ -11,6 +11,11 @@ public:
   {
   }
 
+  // Fixed seed, for reproducible sequences. Must be non-zero for the xorshift generators.
+  explicit prng(uint64_t seed) : _state(seed)
+  {
+  }
+
   void seed()
   {
     _state = static_cast<uint64_t>(std::random_device{}()) << 32 | std::random_device{}();
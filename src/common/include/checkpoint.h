@@ -0,0 +1,315 @@
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <print>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cluster_histogram.h"
+#include "results_file.h"
+#include "timer.h"
+
+/*
+Progress of a run_simulations loop, enough to carry on from where an interrupted run stopped: the summed histogram, the number of
+simulations done, the engine state and the size of the results file once their records were appended, so that records of a
+simulation which was cut short can be dropped and it can be run again.
+*/
+struct run_checkpoint
+{
+  uint32_t num_simulations;
+  uint32_t completed;
+  uint64_t next_simulation_id; // Simulation id of counter-based runs, see cubic_bond_percolation::set_seed
+  uint64_t results_size;
+  std::string rng_state; // As written by the engine's operator<<
+  cluster_histogram results;
+};
+
+template <typename engine>
+std::string engine_state(const engine& rng)
+{
+  std::ostringstream state;
+  state << rng;
+  return state.str();
+}
+
+template <typename engine>
+void restore_engine(engine& rng, const std::string& state)
+{
+  std::istringstream stream(state);
+  stream >> rng;
+}
+
+/*
+Checkpoints of a run, next to its results file with the extension .checkpoint. save hands a checkpoint to a background thread, which
+writes it to a temporary file and renames it over the last one, so a checkpoint on disk is always complete, and simulations do not
+wait on the disk. Checkpoints saved faster than they are written are skipped, except the last one.
+
+The checkpoint of a finished run is kept, so that restarting a campaign skips runs already done: delete it to run the same
+parameters again.
+*/
+class checkpoint_file
+{
+public:
+  checkpoint_file(const std::filesystem::path& results_path, const results_header& header)
+      : _path(checkpoint_path(results_path)), _header(header), _thread(&checkpoint_file::write_checkpoints, this)
+  {
+  }
+
+  // Writes out the last checkpoint saved
+  ~checkpoint_file()
+  {
+    {
+      std::lock_guard lock(_mutex);
+      _stop = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+  }
+
+  checkpoint_file(const checkpoint_file&) = delete;
+  checkpoint_file& operator=(const checkpoint_file&) = delete;
+
+  // Checkpoint of an interrupted or finished run of num_simulations simulations with the same parameters, if any
+  std::optional<run_checkpoint> load(uint32_t num_simulations) const
+  {
+    std::ifstream file(_path, std::ios::binary);
+    if (!file)
+    {
+      return std::nullopt;
+    }
+    const std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t offset = 0;
+    const auto read = [&](void* value, size_t size)
+    {
+      if (offset + size > data.size())
+      {
+        throw std::runtime_error(std::format("Checkpoint {} is truncated", _path.string()));
+      }
+      std::memcpy(value, data.data() + offset, size);
+      offset += size;
+    };
+
+    char magic[sizeof(expected_magic)];
+    results_header header;
+    run_checkpoint checkpoint;
+    uint64_t state_size;
+    uint64_t num_buckets;
+
+    try
+    {
+      read(magic, sizeof(magic));
+      read(&header, sizeof(header));
+      if (std::memcmp(magic, expected_magic, sizeof(magic)) != 0 || !header.same_run(_header))
+      {
+        std::println("Ignoring checkpoint {} of a different run", _path.string());
+        return std::nullopt;
+      }
+
+      read(&checkpoint.num_simulations, sizeof(checkpoint.num_simulations));
+      read(&checkpoint.completed, sizeof(checkpoint.completed));
+      read(&checkpoint.next_simulation_id, sizeof(checkpoint.next_simulation_id));
+      read(&checkpoint.results_size, sizeof(checkpoint.results_size));
+      read(&state_size, sizeof(state_size));
+      checkpoint.rng_state.resize(state_size);
+      read(checkpoint.rng_state.data(), state_size);
+      read(&num_buckets, sizeof(num_buckets));
+      checkpoint.results.resize(num_buckets);
+      read(checkpoint.results.data(), num_buckets * sizeof(cluster_histogram::value_type));
+    }
+    catch (const std::runtime_error& error)
+    {
+      std::println("Ignoring checkpoint: {}", error.what());
+      return std::nullopt;
+    }
+
+    if (checkpoint.num_simulations != num_simulations)
+    {
+      std::println("Ignoring checkpoint {} of a run of {} simulations", _path.string(), checkpoint.num_simulations);
+      return std::nullopt;
+    }
+    return checkpoint;
+  }
+
+  /*
+  Delete the checkpoint next to the results file at results_path, for records appended there outside of a checkpointed run: resuming
+  from it would truncate them away. A run with the same parameters then starts over after them.
+  */
+  static void discard(const std::filesystem::path& results_path)
+  {
+    std::filesystem::remove(checkpoint_path(results_path));
+  }
+
+  void save(run_checkpoint checkpoint)
+  {
+    {
+      std::lock_guard lock(_mutex);
+      _pending = std::move(checkpoint);
+    }
+    _wake.notify_one();
+  }
+
+private:
+  static constexpr char expected_magic[8] = {'P', 'E', 'R', 'C', 'C', 'K', 'P', '\0'};
+
+  static std::filesystem::path checkpoint_path(const std::filesystem::path& results_path)
+  {
+    return std::filesystem::path(results_path).replace_extension(".checkpoint");
+  }
+
+  void write_checkpoints()
+  {
+    std::unique_lock lock(_mutex);
+    while (true)
+    {
+      _wake.wait(lock, [this]() { return _stop || _pending; });
+      if (!_pending)
+      {
+        return;
+      }
+
+      const run_checkpoint checkpoint = std::move(*_pending);
+      _pending.reset();
+
+      lock.unlock();
+      try
+      {
+        write(checkpoint);
+      }
+      catch (const std::runtime_error& error)
+      {
+        std::println("Failed to write checkpoint: {}", error.what());
+      }
+      lock.lock();
+    }
+  }
+
+  void write(const run_checkpoint& checkpoint) const
+  {
+    std::string data;
+    const auto append = [&](const void* value, size_t size) { data.append(static_cast<const char*>(value), size); };
+
+    const uint64_t state_size = checkpoint.rng_state.size();
+    const uint64_t num_buckets = checkpoint.results.size();
+    append(expected_magic, sizeof(expected_magic));
+    append(&_header, sizeof(_header));
+    append(&checkpoint.num_simulations, sizeof(checkpoint.num_simulations));
+    append(&checkpoint.completed, sizeof(checkpoint.completed));
+    append(&checkpoint.next_simulation_id, sizeof(checkpoint.next_simulation_id));
+    append(&checkpoint.results_size, sizeof(checkpoint.results_size));
+    append(&state_size, sizeof(state_size));
+    append(checkpoint.rng_state.data(), state_size);
+    append(&num_buckets, sizeof(num_buckets));
+    append(checkpoint.results.data(), num_buckets * sizeof(cluster_histogram::value_type));
+
+    std::filesystem::path temporary_path = _path;
+    temporary_path += ".tmp";
+
+    const int fd = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd == -1)
+    {
+      throw std::runtime_error(std::format("Failed to open {}: {}", temporary_path.string(), std::strerror(errno)));
+    }
+    const bool written = ::write(fd, data.data(), data.size()) == static_cast<ssize_t>(data.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!written)
+    {
+      throw std::runtime_error(std::format("Failed to write {}: {}", temporary_path.string(), std::strerror(errno)));
+    }
+
+    std::filesystem::rename(temporary_path, _path);
+  }
+
+  const std::filesystem::path _path;
+  const results_header _header;
+
+  std::mutex _mutex;
+  std::condition_variable _wake;
+  std::optional<run_checkpoint> _pending;
+  bool _stop = false;
+
+  std::thread _thread; // Last, so that it starts once everything else is constructed
+};
+
+/*
+The simulation loop shared by the run_simulations of every model: opens the results file at path and its checkpoint, resumes from
+the checkpoint if there is one and the file still holds the results it counts, then calls simulate(simulation_count) for each
+simulation left, which runs it with rng and returns its histogram. Each histogram is appended to the results file and a checkpoint
+saved after it. Records are numbered by simulation_count, or in counter-based runs by *simulation_id, which is restored on resume
+and advanced after each simulation. Returns the sum of the histograms of all num_simulations simulations, resumed ones included.
+*/
+template <typename engine, typename function>
+cluster_histogram run_checkpointed_simulations(const std::filesystem::path& path, const results_header& header, uint32_t num_simulations,
+                                               engine& rng, function&& simulate, uint64_t* simulation_id = nullptr)
+{
+  results_writer writer(path, header);
+  checkpoint_file checkpoints(path, header);
+  timer tm;
+
+  run_checkpoint state = {num_simulations, 0, simulation_id ? *simulation_id : 0, writer.size(), engine_state(rng), {}};
+  std::optional<run_checkpoint> checkpoint = checkpoints.load(num_simulations);
+  if (checkpoint && checkpoint->results_size > writer.size())
+  {
+    // Truncating would pad the file with zeroed records: it was replaced or cut short since the checkpoint
+    std::println("Ignoring checkpoint of {} bytes of results, {} holds only {}", checkpoint->results_size, path.string(), writer.size());
+    checkpoint.reset();
+  }
+
+  if (checkpoint)
+  {
+    std::println("Resuming from simulation {}", checkpoint->completed);
+    state = std::move(*checkpoint);
+    writer.truncate(state.results_size);
+    restore_engine(rng, state.rng_state);
+    if (simulation_id)
+    {
+      *simulation_id = state.next_simulation_id;
+    }
+  }
+  else
+  {
+    checkpoints.save(state);
+  }
+
+  for (uint32_t simulation_count = state.completed; simulation_count < num_simulations; ++simulation_count)
+  {
+    std::print("Simulation number: {}", simulation_count);
+    tm.restart();
+
+    const cluster_histogram simulation_results = simulate(simulation_count);
+    writer.append(simulation_id ? *simulation_id : simulation_count, simulation_results);
+    merge_histograms(state.results, simulation_results);
+
+    tm.stop();
+    std::print(" finished in {} ms\n", tm.get_ms());
+
+    if (simulation_id)
+    {
+      ++*simulation_id;
+    }
+
+    state.completed = simulation_count + 1;
+    state.next_simulation_id = simulation_id ? *simulation_id : 0;
+    state.results_size = writer.size();
+    state.rng_state = engine_state(rng);
+    checkpoints.save(state);
+  }
+
+  return std::move(state.results);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <bit>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+Number of sites of the central cube in clusters of size [2^b, 2^(b+1)) for each bucket b, split into (terminated, still growing),
+i.e. clusters which do not / do touch the boundary of the simulation.
+*/
+using cluster_histogram = std::vector<std::pair<uint64_t, uint64_t>>;
+
+// Add count sites in a cluster of the given signed size (negative if the cluster touches the boundary)
+inline void add_to_histogram(cluster_histogram& histogram, int64_t size, uint64_t count)
+{
+  const uint32_t bucket = std::bit_width(static_cast<uint64_t>(std::abs(size))) - 1;
+  if (histogram.size() < bucket + 1)
+  {
+    histogram.resize(bucket + 1, std::pair<uint64_t, uint64_t>(0, 0));
+  }
+
+  if (size > 0)
+  {
+    histogram[bucket].first += count;
+  }
+  else
+  {
+    histogram[bucket].second += count;
+  }
+}
+
+inline void merge_histograms(cluster_histogram& results, const cluster_histogram& new_results)
+{
+  if (new_results.size() > results.size())
+  {
+    results.resize(new_results.size(), std::pair<uint64_t, uint64_t>(0, 0));
+  }
+
+  for (size_t i = 0; i < new_results.size(); ++i)
+  {
+    results[i].first += new_results[i].first;
+    results[i].second += new_results[i].second;
+  }
+}
+
+// Write out the summed histogram of a run of simulations to results_path, in the format read by the notebook
+inline void write_histogram_csv(const std::filesystem::path& results_path, double probability, size_t central_cube_size, size_t cube_size,
+                                uint64_t num_simulations, const cluster_histogram& results)
+{
+  std::filesystem::create_directories(results_path.parent_path());
+  std::ofstream data_file(results_path);
+
+  data_file << "probability, central cube size, simulation size, number of simulations\n";
+  data_file << std::format("{:.10f}, {}, {}, {}\n", probability, central_cube_size, cube_size, num_simulations);
+  data_file << "\nstart size,number terminated,number still growing\n";
+
+  for (size_t bucket = 0; bucket < results.size(); ++bucket)
+  {
+    data_file << std::format("{}, {}, {}\n", bucket + 1, results[bucket].first, results[bucket].second);
+  }
+}
+
+// As above, to src/analyse_data/data/<folder_name>/
+inline void write_histogram_csv(const std::string& folder_name, const std::string& model_name, double probability, size_t central_cube_size,
+                                size_t cube_size, uint64_t num_simulations, const cluster_histogram& results)
+{
+  write_histogram_csv(std::format("src/analyse_data/data/{}/{}_p_{:.10f}_centre_{}_size_{}_num_{}.csv", folder_name, model_name, probability,
+                                  central_cube_size, cube_size, num_simulations),
+                      probability, central_cube_size, cube_size, num_simulations, results);
+}
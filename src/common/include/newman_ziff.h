@@ -0,0 +1,246 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cluster_histogram.h"
+#include "percolation.h"
+
+/*
+Newman-Ziff: rather than simulating each p separately, add bonds one at a time in a random order and record the observables after
+every bond (the microcanonical ensemble, n open bonds), then average them over the binomial distribution of n to get the
+canonical ensemble at any p:
+
+  Q(p) = sum_n C(M, n) p^n (1 - p)^(M - n) Q(n)
+
+For a whole lattice only a window of bond counts matters: the binomial has a width of about sqrt(M p (1 - p)), so 3 L^3 bonds at
+p_c span only ~1e-5 in p. The simulation therefore opens every bond with activation time below the start of the window in bulk,
+then hands the bonds inside the window to newman_ziff_sweep in order of activation time. Sorting iid uniform activation times
+gives a uniformly random order, so this is exactly Newman-Ziff restricted to the window.
+
+Observables are recorded as a log of changes (a merge touches at most four of them), and each canonical average is computed from
+the log using tail sums of the binomial weights, so the cost is linear in the number of bonds added and of probabilities asked for.
+*/
+
+// A bond inside the window, between the nodes with the given indices
+struct newman_ziff_bond
+{
+  uint64_t activation; // Open for p > activation / 2^64
+  size_t index1;
+  size_t index2;
+};
+
+// Canonical averages at one probability, per simulation
+struct newman_ziff_estimate
+{
+  double probability;
+  double coverage; // Binomial weight inside the window, should be close to 1
+
+  double largest_cluster;
+  double boundary_clusters;                           // Clusters touching the boundary of the simulation
+  std::vector<std::pair<double, double>> histogram;   // As cluster_histogram: central sites by bucket, (terminated, still growing)
+};
+
+/*
+One sweep over a forest: the percolation type must provide cluster_root find_cluster(size_t) and merge_clusters(root1, root2),
+see basic_percolation. The initial state is that of the forest after the bulk bonds, with central_sites giving the number of
+central sites in each cluster by root (clusters with none may be left out).
+*/
+class newman_ziff_sweep
+{
+public:
+  newman_ziff_sweep(uint64_t initial_bonds, const cluster_histogram& histogram, uint64_t largest_cluster, uint64_t boundary_clusters,
+                    std::unordered_map<size_t, uint64_t> central_sites)
+      : _initial_bonds(initial_bonds), _largest_cluster(largest_cluster), _central_sites(std::move(central_sites))
+  {
+    _initial_values.resize(first_bucket + 2 * max_buckets, 0);
+    _initial_values[largest_observable] = largest_cluster;
+    _initial_values[boundary_observable] = boundary_clusters;
+    for (size_t bucket = 0; bucket < histogram.size(); ++bucket)
+    {
+      _initial_values[first_bucket + 2 * bucket] = histogram[bucket].first;
+      _initial_values[first_bucket + 2 * bucket + 1] = histogram[bucket].second;
+    }
+  }
+
+  template <typename percolation_type>
+  void add_bond(percolation_type& forest, size_t index1, size_t index2)
+  {
+    ++_steps;
+
+    const cluster_root cluster1 = forest.find_cluster(index1);
+    const cluster_root cluster2 = forest.find_cluster(index2);
+    if (cluster1.index == cluster2.index)
+    {
+      return;
+    }
+
+    const uint64_t central1 = take_central_sites(cluster1.index);
+    const uint64_t central2 = take_central_sites(cluster2.index);
+    record(histogram_observable(cluster1.size), -static_cast<int64_t>(central1));
+    record(histogram_observable(cluster2.size), -static_cast<int64_t>(central2));
+
+    forest.merge_clusters(cluster1.index, cluster2.index);
+    const cluster_root merged = forest.find_cluster(cluster1.index);
+
+    if (central1 + central2 > 0)
+    {
+      _central_sites[merged.index] = central1 + central2;
+      record(histogram_observable(merged.size), central1 + central2);
+    }
+    if (static_cast<uint64_t>(std::abs(merged.size)) > _largest_cluster)
+    {
+      record(largest_observable, std::abs(merged.size) - _largest_cluster);
+      _largest_cluster = std::abs(merged.size);
+    }
+    if (cluster1.size < 0 && cluster2.size < 0)
+    {
+      record(boundary_observable, -1);
+    }
+  }
+
+  // Canonical averages at p, for a lattice with num_bonds bonds in total
+  newman_ziff_estimate canonical(double p, uint64_t num_bonds) const
+  {
+    // tail[s] is the binomial weight of having at least _initial_bonds + s open bonds, within the window
+    std::vector<double> tail(_steps + 2, 0);
+    const double log_normalisation = std::lgamma(num_bonds + 1.0);
+    for (size_t step = _steps + 1; step-- > 0;)
+    {
+      const double n = _initial_bonds + step;
+      const double log_weight =
+          log_normalisation - std::lgamma(n + 1) - std::lgamma(num_bonds - n + 1) + n * std::log(p) + (num_bonds - n) * std::log1p(-p);
+      tail[step] = tail[step + 1] + (n <= num_bonds ? std::exp(log_weight) : 0);
+    }
+
+    std::vector<double> values(_initial_values.size());
+    for (size_t observable = 0; observable < values.size(); ++observable)
+    {
+      values[observable] = _initial_values[observable] * tail[0];
+    }
+    for (const change& event : _changes)
+    {
+      values[event.observable] += event.delta * tail[event.step];
+    }
+
+    newman_ziff_estimate estimate{p, tail[0], 0, 0, {}};
+    const double normalisation = tail[0] > 0 ? 1 / tail[0] : 0;
+    estimate.largest_cluster = values[largest_observable] * normalisation;
+    estimate.boundary_clusters = values[boundary_observable] * normalisation;
+
+    size_t num_buckets = max_buckets;
+    while (num_buckets > 0 && values[first_bucket + 2 * num_buckets - 2] == 0 && values[first_bucket + 2 * num_buckets - 1] == 0)
+    {
+      --num_buckets;
+    }
+    for (size_t bucket = 0; bucket < num_buckets; ++bucket)
+    {
+      estimate.histogram.emplace_back(values[first_bucket + 2 * bucket] * normalisation, values[first_bucket + 2 * bucket + 1] * normalisation);
+    }
+
+    return estimate;
+  }
+
+  uint64_t steps() const
+  {
+    return _steps;
+  }
+
+private:
+  static constexpr uint32_t largest_observable = 0;
+  static constexpr uint32_t boundary_observable = 1;
+  static constexpr uint32_t first_bucket = 2;
+  static constexpr uint32_t max_buckets = 64;
+
+  struct change
+  {
+    uint64_t step; // Number of bonds added in the window when the change happened
+    uint32_t observable;
+    int64_t delta;
+  };
+
+  static uint32_t histogram_observable(int64_t size)
+  {
+    return first_bucket + 2 * (std::bit_width(static_cast<uint64_t>(std::abs(size))) - 1) + (size < 0);
+  }
+
+  void record(uint32_t observable, int64_t delta)
+  {
+    if (delta != 0)
+    {
+      _changes.push_back({_steps, observable, delta});
+    }
+  }
+
+  uint64_t take_central_sites(size_t root)
+  {
+    const auto it = _central_sites.find(root);
+    if (it == _central_sites.end())
+    {
+      return 0;
+    }
+    const uint64_t count = it->second;
+    _central_sites.erase(it);
+    return count;
+  }
+
+  const uint64_t _initial_bonds;
+  uint64_t _steps = 0;
+  uint64_t _largest_cluster;
+  std::unordered_map<size_t, uint64_t> _central_sites;
+
+  std::vector<double> _initial_values;
+  std::vector<change> _changes;
+};
+
+// Add an estimate to a running sum of estimates at the same probability
+inline void merge_estimates(newman_ziff_estimate& results, const newman_ziff_estimate& new_results)
+{
+  results.coverage += new_results.coverage;
+  results.largest_cluster += new_results.largest_cluster;
+  results.boundary_clusters += new_results.boundary_clusters;
+  if (new_results.histogram.size() > results.histogram.size())
+  {
+    results.histogram.resize(new_results.histogram.size(), std::pair<double, double>(0, 0));
+  }
+  for (size_t bucket = 0; bucket < new_results.histogram.size(); ++bucket)
+  {
+    results.histogram[bucket].first += new_results.histogram[bucket].first;
+    results.histogram[bucket].second += new_results.histogram[bucket].second;
+  }
+}
+
+/*
+Write out the canonical averages at one probability (summed over num_sweeps sweeps, written per simulation) to
+src/analyse_data/data/<folder_name>/, in the layout of write_histogram_csv.
+*/
+inline void write_newman_ziff_csv(const std::string& folder_name, const std::string& model_name, size_t central_cube_size, size_t cube_size,
+                                  uint32_t num_sweeps, const newman_ziff_estimate& results)
+{
+  std::filesystem::path results_path = std::format("src/analyse_data/data/{}/{}_newman_ziff_p_{:.10f}_centre_{}_size_{}_num_{}.csv", folder_name,
+                                                   model_name, results.probability, central_cube_size, cube_size, num_sweeps);
+  std::filesystem::create_directories(results_path.parent_path());
+  std::ofstream data_file(results_path);
+
+  data_file << "probability, central cube size, simulation size, number of sweeps, binomial weight covered\n";
+  data_file << std::format("{:.10f}, {}, {}, {}, {:.6f}\n", results.probability, central_cube_size, cube_size, num_sweeps,
+                           results.coverage / num_sweeps);
+  data_file << "\nlargest cluster, boundary clusters\n";
+  data_file << std::format("{:.3f}, {:.3f}\n", results.largest_cluster / num_sweeps, results.boundary_clusters / num_sweeps);
+  data_file << "\nstart size,number terminated,number still growing\n";
+
+  for (size_t bucket = 0; bucket < results.histogram.size(); ++bucket)
+  {
+    data_file << std::format("{}, {:.6f}, {:.6f}\n", bucket + 1, results.histogram[bucket].first / num_sweeps,
+                             results.histogram[bucket].second / num_sweeps);
+  }
+}
@@ -1,19 +1,105 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <barrier>
 #include <limits>
-#include <map>
+#include <numeric>
 #include <print>
 #include <queue>
+#include <span>
+#include <stdexcept>
 #include <stdint.h>
+#include <thread>
+#include <vector>
 
 #include "gnuplot-iostream.h"
 
 #include "disjoint_set_forest.hpp"
 #include "timer.h"
 
-template <typename element>
-class percolation : public disjoint_set_forest<element>
+/*
+Identifies a cluster by its root. Ordered by size, from the smallest to the largest cluster.
+NOTE: second part of the comparison is to ensure different clusters are distinct, and gives a deterministic order among equal sizes.
+*/
+struct cluster_root
+{
+  bool operator<(const cluster_root& rhs) const
+  {
+    return std::abs(size) < std::abs(rhs.size) || (std::abs(size) == std::abs(rhs.size) && index < rhs.index);
+  }
+
+  size_t index; // Index of the root in the forest
+  int64_t size; // Negative if the cluster hits the boundary
+};
+
+/*
+Sites grouped by cluster in compressed sparse row form: cluster c has root roots[c] and its sites are the forest indices
+sites[offsets[c]] to sites[offsets[c + 1] - 1], in increasing order. Clusters are sorted from the largest to the smallest.
+*/
+struct cluster_list
+{
+  size_t size() const
+  {
+    return roots.size();
+  }
+
+  size_t cluster_size(size_t cluster) const
+  {
+    return offsets[cluster + 1] - offsets[cluster];
+  }
+
+  std::span<const size_t> cluster_sites(size_t cluster) const
+  {
+    return std::span<const size_t>(sites).subspan(offsets[cluster], cluster_size(cluster));
+  }
+
+  std::vector<cluster_root> roots;
+  std::vector<size_t> offsets;
+  std::vector<size_t> sites;
+};
+
+/*
+Cluster of every site by dense label: the labels are numbered 0, 1, ... in order of the root's index, so a scan over sites reads
+one small word per site, and clusters gives the root and signed size for each label.
+*/
+struct cluster_labels
+{
+  cluster_root operator[](size_t index) const
+  {
+    return clusters[labels[index]];
+  }
+
+  std::vector<uint32_t> labels;
+  std::vector<cluster_root> clusters;
+};
+
+// Call f(thread) for thread = 0, ..., num_threads - 1, each on its own thread, with thread 0 on the calling thread
+template <typename function>
+void run_on_threads(uint32_t num_threads, const function& f)
+{
+  std::vector<std::thread> threads;
+  for (uint32_t thread = 1; thread < num_threads; ++thread)
+  {
+    threads.emplace_back(f, thread);
+  }
+  f(0);
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+}
+
+// Call f(start, end) on num_threads contiguous chunks of [0, count), each on its own thread
+template <typename function>
+void for_each_chunk(size_t count, uint32_t num_threads, const function& f)
+{
+  num_threads = std::clamp<size_t>(num_threads, 1, std::max<size_t>(count, 1));
+  run_on_threads(num_threads, [&](uint32_t thread) { f(thread * count / num_threads, (thread + 1) * count / num_threads); });
+}
+
+template <typename lattice, typename element, typename node_type = packed_node>
+class basic_percolation : public basic_disjoint_set_forest<lattice, element, node_type>
 {
   /*
   Can possibly use a disjoint set union data structure.
@@ -22,33 +108,230 @@ class percolation : public disjoint_set_forest<element>
   Expected complexity: Should be amortized O(n*ackerman^-1(n)).
   */
 public:
-  using node = typename percolation<element>::node;
+  using node = typename basic_disjoint_set_forest<lattice, element, node_type>::node;
 
-  percolation(size_t num_elements) : disjoint_set_forest<element>(num_elements)
+  basic_percolation(size_t num_elements, page_policy pages = page_policy::normal)
+      : basic_disjoint_set_forest<lattice, element, node_type>(num_elements, pages)
   {
   }
 
-  std::map<node, std::vector<element>> get_clusters_sorted(size_t minimum_size) const
+  // Roots of the clusters with at least minimum_size sites, largest first
+  std::vector<cluster_root> get_roots_sorted(size_t minimum_size) const
   {
-    std::map<node, std::vector<element>> clusters;
-
+    std::vector<cluster_root> roots;
     for (size_t index = 0; index < this->_forest.size(); ++index)
     {
-      const node& root = *this->find_const(&this->_forest[index]);
-
-      if (std::abs(root.size) >= minimum_size)
+      if (this->_forest[index].is_root(index) && std::abs(this->cluster_size(index)) >= minimum_size)
       {
-        if (clusters.contains(root))
-        {
-          clusters.at(root).push_back(this->get_element(index));
-        }
-        else
-        {
-          clusters.emplace(root, std::vector<element>({this->get_element(index)}));
-        }
+        roots.push_back({index, this->cluster_size(index)});
       }
     }
 
+    std::sort(roots.begin(), roots.end(), [](const cluster_root& lhs, const cluster_root& rhs) { return rhs < lhs; });
+    return roots;
+  }
+
+  /*
+  Sites of the clusters with at least minimum_size sites, largest cluster first, by counting sort: the roots give the size of every
+  cluster and so its offset, then the sites are scattered into place in chunks, one per thread, and each cluster's sites sorted.
+  */
+  cluster_list get_clusters_sorted(size_t minimum_size, uint32_t num_threads = 1) const
+  {
+    cluster_list clusters;
+    clusters.roots = get_roots_sorted(minimum_size);
+    if (clusters.roots.size() >= std::numeric_limits<uint32_t>::max())
+    {
+      throw std::length_error("Too many clusters to label");
+    }
+
+    // Label of each cluster by root, no_label for the sites of smaller clusters
+    constexpr uint32_t no_label = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> labels(this->_forest.size(), no_label);
+
+    clusters.offsets.resize(clusters.roots.size() + 1, 0);
+    for (size_t cluster = 0; cluster < clusters.roots.size(); ++cluster)
+    {
+      labels[clusters.roots[cluster].index] = cluster;
+      clusters.offsets[cluster + 1] = clusters.offsets[cluster] + std::abs(clusters.roots[cluster].size);
+    }
+
+    clusters.sites.resize(clusters.offsets.back());
+    std::vector<std::atomic<size_t>> next_site(clusters.roots.size());
+    for (size_t cluster = 0; cluster < clusters.roots.size(); ++cluster)
+    {
+      next_site[cluster].store(clusters.offsets[cluster], std::memory_order_relaxed);
+    }
+
+    for_each_chunk(this->_forest.size(), num_threads,
+                   [&](size_t start, size_t end)
+                   {
+                     for (size_t index = start; index < end; ++index)
+                     {
+                       const uint32_t label = labels[this->find_root_const(index)];
+                       if (label != no_label)
+                       {
+                         clusters.sites[next_site[label].fetch_add(1, std::memory_order_relaxed)] = index;
+                       }
+                     }
+                   });
+
+    // Threads interleave within a cluster, so put each one back in order of index
+    for_each_chunk(clusters.roots.size(), num_threads,
+                   [&](size_t start, size_t end)
+                   {
+                     for (size_t cluster = start; cluster < end; ++cluster)
+                     {
+                       std::sort(clusters.sites.begin() + clusters.offsets[cluster], clusters.sites.begin() + clusters.offsets[cluster + 1]);
+                     }
+                   });
+
     return clusters;
   }
+
+  // Elements of the sites of one cluster of a cluster_list, e.g. for plotting
+  std::vector<element> get_cluster_elements(const cluster_list& clusters, size_t cluster) const
+  {
+    std::vector<element> elements;
+    elements.reserve(clusters.cluster_size(cluster));
+    for (const size_t index : clusters.cluster_sites(cluster))
+    {
+      elements.push_back(this->derived().get_element(index));
+    }
+    return elements;
+  }
+
+  /*
+  Point every node straight at its root, so that afterwards get_root and find_cluster take at most one step. Meant to be run once
+  a configuration is complete, before analysing it several times over.
+
+  Nodes are done in blocks: every thread first finds the roots of its share of a block without modifying the forest, then, once
+  all threads are done reading, writes them. Later blocks mostly walk into nodes already flattened, so their paths are short.
+  */
+  void flatten(uint32_t num_threads = 1)
+  {
+    constexpr size_t thread_block_size = size_t(1) << 16;
+
+    num_threads = std::max<uint32_t>(num_threads, 1);
+    const size_t block_size = num_threads * thread_block_size;
+    std::vector<size_t> roots(block_size);
+    std::barrier sync(num_threads);
+
+    run_on_threads(num_threads,
+                   [&](uint32_t thread)
+                   {
+                     for (size_t block = 0; block < this->_forest.size(); block += block_size)
+                     {
+                       const size_t start = block + thread * thread_block_size;
+                       const size_t end = std::min(start + thread_block_size, this->_forest.size());
+
+                       for (size_t index = start; index < end; ++index)
+                       {
+                         roots[index - block] = this->find_root_const(index);
+                       }
+                       sync.arrive_and_wait();
+
+                       for (size_t index = start; index < end; ++index)
+                       {
+                         if (roots[index - block] != index)
+                         {
+                           this->_forest[index].set_parent(roots[index - block]);
+                         }
+                       }
+                       sync.arrive_and_wait();
+                     }
+                   });
+  }
+
+  // Flatten the forest, then label the cluster of every site, see cluster_labels
+  cluster_labels label_clusters(uint32_t num_threads = 1)
+  {
+    flatten(num_threads);
+
+    num_threads = std::clamp<size_t>(num_threads, 1, std::max<size_t>(this->_forest.size(), 1));
+    const auto chunk_start = [&](uint32_t thread) { return thread * this->_forest.size() / num_threads; };
+
+    // First label of each chunk, from the number of roots in the chunks before it
+    std::vector<size_t> first_label(num_threads + 1, 0);
+    run_on_threads(num_threads,
+                   [&](uint32_t thread)
+                   {
+                     for (size_t index = chunk_start(thread); index < chunk_start(thread + 1); ++index)
+                     {
+                       first_label[thread + 1] += this->_forest[index].is_root(index);
+                     }
+                   });
+    std::partial_sum(first_label.begin(), first_label.end(), first_label.begin());
+    if (first_label.back() > std::numeric_limits<uint32_t>::max())
+    {
+      throw std::length_error("Too many clusters to label");
+    }
+
+    cluster_labels result;
+    result.labels.resize(this->_forest.size());
+    result.clusters.resize(first_label.back());
+    std::barrier sync(num_threads);
+
+    run_on_threads(num_threads,
+                   [&](uint32_t thread)
+                   {
+                     size_t label = first_label[thread];
+                     for (size_t index = chunk_start(thread); index < chunk_start(thread + 1); ++index)
+                     {
+                       if (this->_forest[index].is_root(index))
+                       {
+                         result.labels[index] = label;
+                         result.clusters[label++] = {index, this->cluster_size(index)};
+                       }
+                     }
+                     sync.arrive_and_wait();
+
+                     // Flattened, so every other node's parent is its root
+                     for (size_t index = chunk_start(thread); index < chunk_start(thread + 1); ++index)
+                     {
+                       if (!this->_forest[index].is_root(index))
+                       {
+                         result.labels[index] = result.labels[this->_forest[index].parent(index)];
+                       }
+                     }
+                   });
+
+    return result;
+  }
+
+  // Root and signed size of the cluster of the node with the given index, compressing its path on the way
+  force_inline cluster_root find_cluster(size_t index)
+  {
+    const size_t root = this->find_root(index);
+    return {root, this->cluster_size(root)};
+  }
+
+  // Merge the clusters with the given roots, as found by find_cluster
+  force_inline void merge_clusters(size_t root1, size_t root2)
+  {
+    this->merge_indices(root1, root2);
+  }
+
+protected:
+  force_inline cluster_root get_root(size_t index) const
+  {
+    const size_t root = this->find_root_const(index);
+    return {root, this->cluster_size(root)};
+  }
+};
+
+// Runtime-polymorphic adapter, see disjoint_set_forest
+template <typename element>
+class percolation : public basic_percolation<percolation<element>, element>
+{
+public:
+  percolation(size_t num_elements) : basic_percolation<percolation<element>, element>(num_elements)
+  {
+  }
+
+  virtual ~percolation() = default;
+
+  virtual size_t get_index(const element& node) const = 0;
+  virtual element get_element(size_t index) const = 0;
+
+  virtual bool on_boundary(const element& node) const = 0;
 };
\ No newline at end of file
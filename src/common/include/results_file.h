@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <print>
+#include <span>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cluster_histogram.h"
+
+/*
+Binary results: a fixed header with the parameters of the run, followed by one fixed size record per simulation holding its
+histogram of the central cube (see cluster_histogram.h). Records are appended one write at a time as simulations finish, so a file
+can be read while its run is still going, and runs with the same parameters keep appending to the same file. Everything is little
+endian and fixed width, so numpy can map a file without parsing it:
+
+  header = np.fromfile(path, dtype=results_header_dtype, count=1)[0]
+  record_dtype = np.dtype([("simulation", "<u8"), ("histogram", "<u8", (header["num_buckets"], 2))])
+  records = np.memmap(path, offset=128, mode="r", dtype=record_dtype,
+                      shape=((os.path.getsize(path) - 128) // record_dtype.itemsize,))
+
+with results_header_dtype following results_header below field by field. histogram[:, 0] is terminated and histogram[:, 1] still
+growing. A record cut short at the end of the file, by a crash or a full disk, is left out by readers (hence the explicit shape
+above), and cut off by the next results_writer to open the file, before it appends anything.
+*/
+struct results_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_buckets; // Histogram buckets per record, enough for a cluster of the whole simulation
+  double probability;
+  uint64_t central_cube_size;
+  uint64_t cube_size;
+  uint64_t campaign_seed; // Seed of counter-based runs, see cubic_bond_percolation::set_seed, else 0
+  char model_name[48]; // Grew into the reserved bytes, which older files left zeroed, so their names still read the same
+  char reserved[32];
+
+  static constexpr char expected_magic[8] = {'P', 'E', 'R', 'C', 'R', 'E', 'S', '\0'};
+  static constexpr uint32_t current_version = 1;
+
+  // Whether records of other can go into the same file as records of this header
+  bool same_run(const results_header& other) const
+  {
+    return num_buckets == other.num_buckets && probability == other.probability && central_cube_size == other.central_cube_size &&
+           cube_size == other.cube_size && campaign_seed == other.campaign_seed && std::strncmp(model_name, other.model_name, sizeof(model_name)) == 0;
+  }
+
+  std::string model() const
+  {
+    return std::string(model_name, strnlen(model_name, sizeof(model_name)));
+  }
+
+  size_t record_size() const
+  {
+    return sizeof(uint64_t) * (1 + 2 * num_buckets);
+  }
+};
+
+static_assert(sizeof(results_header) == 128, "results_header is part of the file format");
+
+// dimension of the simulation only sizes the histogram: the model name tells lattices apart
+inline results_header make_results_header(const std::string& model_name, double probability, size_t central_cube_size, size_t cube_size,
+                                          uint64_t campaign_seed = 0, uint32_t dimension = 3)
+{
+  uint64_t num_sites = 1;
+  for (uint32_t d = 0; d < dimension; ++d)
+  {
+    num_sites *= cube_size;
+  }
+
+  results_header header{};
+  std::copy(std::begin(results_header::expected_magic), std::end(results_header::expected_magic), header.magic);
+  header.version = results_header::current_version;
+  header.num_buckets = std::bit_width(num_sites);
+  header.probability = probability;
+  header.central_cube_size = central_cube_size;
+  header.cube_size = cube_size;
+  header.campaign_seed = campaign_seed;
+  std::strncpy(header.model_name, model_name.c_str(), sizeof(header.model_name) - 1);
+  return header;
+}
+
+// Path of the results file of a run, next to its CSV files
+inline std::filesystem::path results_path(const std::string& folder_name, const results_header& header)
+{
+  return std::format("src/analyse_data/data/{}/{}_p_{:.10f}_centre_{}_size_{}.bin", folder_name, header.model(), header.probability,
+                     header.central_cube_size, header.cube_size);
+}
+
+/*
+Appends records to a results file, creating it with the given header if needed. An existing file must have been written with the
+same parameters, and is truncated to its last whole record. Every record is a single write to a file opened for appending, so
+several writers may share a file, as long as none of them opens it or appends to it while another is appending: a failed append cuts
+the file back to its size before the write, which would take records appended meanwhile with it.
+*/
+class results_writer
+{
+public:
+  results_writer(const std::filesystem::path& path, const results_header& header) : _header(header)
+  {
+    std::filesystem::create_directories(path.parent_path());
+
+    _fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (_fd == -1)
+    {
+      throw std::runtime_error(std::format("Failed to open results file {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    results_header existing;
+    const ssize_t existing_size = pread(_fd, &existing, sizeof(existing), 0);
+    if (existing_size == 0)
+    {
+      write_all(&_header, sizeof(_header));
+    }
+    else if (existing_size != sizeof(existing) || std::memcmp(existing.magic, results_header::expected_magic, sizeof(existing.magic)) != 0 ||
+             existing.version != results_header::current_version || !existing.same_run(_header))
+    {
+      close(_fd);
+      throw std::runtime_error(std::format("Results file {} holds a different run", path.string()));
+    }
+    else
+    {
+      // Drop a record cut short, which would otherwise shift every record appended after it
+      const uint64_t file_size = size();
+      const uint64_t whole_size = sizeof(results_header) + (file_size - sizeof(results_header)) / _header.record_size() * _header.record_size();
+      if (whole_size != file_size)
+      {
+        std::println("Dropping {} bytes of a record cut short at the end of {}", file_size - whole_size, path.string());
+        truncate(whole_size);
+      }
+    }
+  }
+
+  ~results_writer()
+  {
+    close(_fd);
+  }
+
+  results_writer(const results_writer&) = delete;
+  results_writer& operator=(const results_writer&) = delete;
+
+  void append(uint64_t simulation_id, const cluster_histogram& histogram)
+  {
+    std::vector<uint64_t> record(1 + 2 * _header.num_buckets, 0);
+    record[0] = simulation_id;
+    for (size_t bucket = 0; bucket < std::min<size_t>(histogram.size(), _header.num_buckets); ++bucket)
+    {
+      record[1 + 2 * bucket] = histogram[bucket].first;
+      record[2 + 2 * bucket] = histogram[bucket].second;
+    }
+    const uint64_t previous_size = size();
+    try
+    {
+      write_all(record.data(), record.size() * sizeof(uint64_t));
+    }
+    catch (const std::runtime_error&)
+    {
+      // Best effort: should this fail too, the next writer to open the file cuts the record off
+      [[maybe_unused]] const int result = ftruncate(_fd, previous_size);
+      throw;
+    }
+  }
+
+  // Size of the file in bytes
+  uint64_t size() const
+  {
+    struct stat file_stat;
+    if (fstat(_fd, &file_stat) != 0)
+    {
+      throw std::runtime_error(std::format("Failed to stat results file: {}", std::strerror(errno)));
+    }
+    return file_stat.st_size;
+  }
+
+  // Drop everything after the first size bytes, e.g. records of simulations to be run again after resuming from a checkpoint
+  void truncate(uint64_t size)
+  {
+    if (ftruncate(_fd, size) != 0)
+    {
+      throw std::runtime_error(std::format("Failed to truncate results file: {}", std::strerror(errno)));
+    }
+  }
+
+  const results_header& header() const
+  {
+    return _header;
+  }
+
+private:
+  void write_all(const void* data, size_t size)
+  {
+    if (write(_fd, data, size) != static_cast<ssize_t>(size))
+    {
+      throw std::runtime_error(std::format("Failed to write results: {}", std::strerror(errno)));
+    }
+  }
+
+  results_header _header;
+  int _fd;
+};
+
+// Read only mapping of a results file
+class results_reader
+{
+public:
+  explicit results_reader(const std::filesystem::path& path)
+  {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+      throw std::runtime_error(std::format("Failed to open results file {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    _file_size = file_stat.st_size;
+    if (_file_size < sizeof(results_header))
+    {
+      close(fd);
+      throw std::runtime_error(std::format("{} is not a results file", path.string()));
+    }
+
+    _data = static_cast<const char*>(mmap(nullptr, _file_size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+    if (_data == MAP_FAILED)
+    {
+      throw std::runtime_error(std::format("Failed to map results file {}: {}", path.string(), std::strerror(errno)));
+    }
+
+    if (std::memcmp(header().magic, results_header::expected_magic, sizeof(header().magic)) != 0 ||
+        header().version != results_header::current_version)
+    {
+      munmap(const_cast<char*>(_data), _file_size);
+      throw std::runtime_error(std::format("{} is not a results file of version {}", path.string(), results_header::current_version));
+    }
+  }
+
+  ~results_reader()
+  {
+    munmap(const_cast<char*>(_data), _file_size);
+  }
+
+  results_reader(const results_reader&) = delete;
+  results_reader& operator=(const results_reader&) = delete;
+
+  const results_header& header() const
+  {
+    return *reinterpret_cast<const results_header*>(_data);
+  }
+
+  // Number of complete records
+  size_t size() const
+  {
+    return (_file_size - sizeof(results_header)) / header().record_size();
+  }
+
+  uint64_t simulation_id(size_t record) const
+  {
+    return this->record(record)[0];
+  }
+
+  cluster_histogram histogram(size_t record) const
+  {
+    const std::span<const uint64_t> words = this->record(record);
+    cluster_histogram result(header().num_buckets);
+    for (size_t bucket = 0; bucket < result.size(); ++bucket)
+    {
+      result[bucket] = {words[1 + 2 * bucket], words[2 + 2 * bucket]};
+    }
+    while (!result.empty() && result.back() == std::pair<uint64_t, uint64_t>(0, 0))
+    {
+      result.pop_back();
+    }
+    return result;
+  }
+
+  // Raw record, the simulation id then (terminated, still growing) for each bucket
+  std::span<const uint64_t> record(size_t record) const
+  {
+    return {reinterpret_cast<const uint64_t*>(_data + sizeof(results_header) + record * header().record_size()), 1 + 2 * size_t(header().num_buckets)};
+  }
+
+private:
+  const char* _data;
+  size_t _file_size;
+};
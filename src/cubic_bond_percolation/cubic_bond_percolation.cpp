@@ -1,333 +1,533 @@
 #include <algorithm>
+#include <atomic>
 #include <bit>
 #include <cmath>
+#include <exception>
 #include <filesystem>
 #include <format>
 #include <fstream>
-#include <future>
+#include <functional>
 #include <limits>
+#include <mutex>
 #include <print>
 #include <queue>
 #include <random>
-#include <set>
-#include <stdint.h>
+#include <unordered_map>
+#include <stdexcept>
 #include <thread>
+#include <utility>
+#include <stdint.h>
 
 #include "cubic_bond_percolation.h"
 
+#include "checkpoint.h"
+#include "cluster_histogram.h"
 #include "colour_names.h"
 #include "gnuplot-iostream.h"
 #include "pcg_extras.hpp"
 #include "pcg_random.hpp"
 #include "percolation.h"
+#include "phase_profiler.h"
 #include "power.h"
+#include "results_file.h"
 #include "timer.h"
 
 // GNU plot has its limitations here. Do not waste too much time fiddling with it, will probably write something proper later anyway.
 
-cubic_bond_percolation::cubic_bond_percolation(uint8_t cube_pow, double p)
-    : percolation(ipow(2, cube_pow * 3u)), _cube_pow(cube_pow), _cube_size(ipow(2, cube_pow)), _probability(p),
-      _bound(std::numeric_limits<uint64_t>::max() * p), _rng(pcg_extras::seed_seq_from<std::random_device>{})
+template <typename node_type, typename layout_type>
+cubic_bond_percolation<node_type, layout_type>::cubic_bond_percolation(uint8_t cube_pow, double p, page_policy pages)
+    : basic_percolation<cubic_bond_percolation<node_type, layout_type>, std::tuple<int, int, int>, node_type>(ipow(size_t(2), cube_pow * 3u), pages),
+      _cube_pow(cube_pow), _cube_size(ipow(2, cube_pow)), _layout(cube_pow), _row_words((_cube_size + 63) / 64), _probability(p),
+      _sampler(p), _rng(pcg_extras::seed_seq_from<std::random_device>{})
 {
-  _gp << "set xrange [0:" << _cube_size << "]" << std::endl;
-  _gp << "set yrange [0:" << _cube_size << "]" << std::endl;
-  _gp << "set zrange [0:" << _cube_size << "]" << std::endl;
-  _gp << "set view equal xyz" << std::endl; // Force grid to be square
-  _gp << "unset border" << std::endl;
-  _gp << "unset xtics" << std::endl;
-  _gp << "unset ytics" << std::endl;
-  _gp << "unset ztics" << std::endl;
-  _gp << "set key outside right top samplen 2 spacing .7 font ',8' tc rgb 'grey40'" << std::endl;
 }
 
-void cubic_bond_percolation::set_probability(double p)
+// Gnuplot process for the plots, started on first use so that simulations which never plot (replicas in particular) do not each start one
+template <typename node_type, typename layout_type>
+Gnuplot& cubic_bond_percolation<node_type, layout_type>::plot() const
+{
+  if (!_gp)
+  {
+    _gp = std::make_unique<Gnuplot>();
+    *_gp << "set xrange [0:" << _cube_size << "]" << std::endl;
+    *_gp << "set yrange [0:" << _cube_size << "]" << std::endl;
+    *_gp << "set zrange [0:" << _cube_size << "]" << std::endl;
+    *_gp << "set view equal xyz" << std::endl; // Force grid to be square
+    *_gp << "unset border" << std::endl;
+    *_gp << "unset xtics" << std::endl;
+    *_gp << "unset ytics" << std::endl;
+    *_gp << "unset ztics" << std::endl;
+    *_gp << "set key outside right top samplen 2 spacing .7 font ',8' tc rgb 'grey40'" << std::endl;
+  }
+  return *_gp;
+}
+
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::set_probability(double p)
 {
   _probability = p;
-  _bound = std::numeric_limits<uint64_t>::max() * p;
+  _sampler.set_probability(p);
 }
 
-// For now, we only use 2^n threads, and max_num_threads is assumed to be >= 2
-void cubic_bond_percolation::generate_clusters_parallel(uint8_t max_num_threads)
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::set_bond_sampling(bond_sampling mode)
 {
-  generate_merge_clusters_recursive(max_num_threads, 0, _cube_size);
+  _sampler.set_mode(mode);
+}
 
-  return;
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::set_thread_affinity(thread_affinity affinity)
+{
+  _affinity = affinity;
 }
 
-void cubic_bond_percolation::generate_merge_clusters_recursive(uint8_t max_num_threads, int start_i, int end_i)
+/*
+The cube is split into slabs of planes, several per thread so that the pool can balance uneven slabs. Slabs are generated as
+independent tasks, and merged pairwise up a binary tree: the merge of two neighbouring ranges of slabs is a task of its own,
+submitted by whichever of its two halves finishes last, so merges run in parallel with the generation of other slabs.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::generate_clusters_parallel(uint8_t num_threads)
 {
-  int middle_i = (start_i + end_i) / 2;
+  thread_pool& threads = pool(num_threads);
+  const size_t num_slabs = std::min<size_t>(_cube_size, 4 * threads.num_threads());
 
-  if (std::min(middle_i - start_i, end_i - middle_i) >= 2 * _cube_size / max_num_threads)
+  // Internal nodes of the merge tree, merging at plane i once both halves are done
+  struct slab_merge
+  {
+    std::atomic<int> pending = 2;
+    int i;
+    int level; // Height in the tree, 0 for merges of two slabs
+    slab_merge* parent;
+  };
+  std::vector<slab_merge> merges(num_slabs);
+  size_t num_merges = 0;
+
+  task_group group;
+
+  // Called when one half of a merge is complete
+  std::function<void(slab_merge*)> complete = [&](slab_merge* merge)
   {
-    // Split each in half again and recurse, joining up afterwards
-    std::thread t1(&cubic_bond_percolation::generate_merge_clusters_recursive, this, max_num_threads, start_i, middle_i);
-    std::thread t2(&cubic_bond_percolation::generate_merge_clusters_recursive, this, max_num_threads, middle_i, end_i);
+    if (merge != nullptr && merge->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+      threads.submit(group,
+                     [&, merge]()
+                     {
+                       merge_clusters_slices(merge->i, merge->level);
+                       complete(merge->parent);
+                     });
+    }
+  };
 
-    t1.join();
-    t2.join();
+  // Build the tree over slabs [first_slab, last_slab), submitting a generation task for each slab
+  const auto slab_start = [&](size_t slab) { return static_cast<int>(slab * _cube_size / num_slabs); };
 
-    merge_clusters_slices(middle_i);
-    return;
-  }
+  std::function<void(size_t, size_t, slab_merge*)> schedule = [&](size_t first_slab, size_t last_slab, slab_merge* parent)
+  {
+    if (last_slab - first_slab == 1)
+    {
+      threads.submit_to(plane_owner(slab_start(first_slab), threads.num_threads()), group,
+                        [&, first_slab, parent]()
+                        {
+                          generate_slab(slab_start(first_slab), slab_start(first_slab + 1));
+                          complete(parent);
+                        });
+      return;
+    }
 
-  std::thread t1(&cubic_bond_percolation::generate_clusters_parallel_thread, this, start_i, middle_i);
-  std::thread t2(&cubic_bond_percolation::generate_clusters_parallel_thread, this, middle_i, end_i);
+    const size_t middle_slab = (first_slab + last_slab) / 2;
+    slab_merge* merge = &merges[num_merges++];
+    merge->i = slab_start(middle_slab);
+    merge->level = std::bit_width(last_slab - first_slab - 1) - 1;
+    merge->parent = parent;
 
-  t1.join();
-  t2.join();
+    schedule(first_slab, middle_slab, merge);
+    schedule(middle_slab, last_slab, merge);
+  };
 
-  merge_clusters_slices(middle_i);
+  schedule(0, num_slabs, nullptr);
+  threads.wait(group);
 
   return;
 }
 
-void cubic_bond_percolation::generate_clusters_parallel_thread(int start_i, int end_i)
+/*
+First make every site a set, then have all threads draw and merge the bonds of their slabs concurrently, including those leading
+into the previous slab.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::generate_clusters_concurrent(uint8_t num_threads)
+  requires is_compact_node<node_type>
 {
+  thread_pool& threads = pool(num_threads);
+  const size_t num_slabs = std::min<size_t>(_cube_size, 4 * threads.num_threads());
+  const auto slab_start = [&](size_t slab) { return static_cast<int>(slab * _cube_size / num_slabs); };
+
+  task_group make_sets;
+  for (size_t slab = 0; slab < num_slabs; ++slab)
+  {
+    threads.submit(make_sets,
+                   [&, slab]()
+                   {
+                     for (int i = slab_start(slab); i < slab_start(slab + 1); ++i)
+                     {
+                       for (int j = 0; j < _cube_size; ++j)
+                       {
+                         for (int k = 0; k < _cube_size; ++k)
+                         {
+                           this->make_set({i, j, k});
+                         }
+                       }
+                     }
+                   });
+  }
+  threads.wait(make_sets);
+
+  task_group merges;
+  for (size_t slab = 0; slab < num_slabs; ++slab)
+  {
+    threads.submit(merges,
+                   [&, slab]()
+                   {
+                     pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+                     std::vector<uint64_t> bonds(3 * _row_words);
+
+                     for (int i = slab_start(slab); i < slab_start(slab + 1); ++i)
+                     {
+                       for (int j = 0; j < _cube_size; ++j)
+                       {
+                         merge_row_concurrent(rng, bonds.data(), i, j);
+                       }
+                     }
+                   });
+  }
+  threads.wait(merges);
+
+  return;
+}
+
+// Same bonds as generate_row, merged with merge_concurrent
+template <typename node_type, typename layout_type>
+template <typename engine>
+force_inline void cubic_bond_percolation<node_type, layout_type>::merge_row_concurrent(engine& rng, uint64_t* bonds, int i, int j)
+  requires is_compact_node<node_type>
+{
+  uint64_t* const k_bonds = bonds;
+  uint64_t* const j_bonds = bonds + _row_words;
+  uint64_t* const i_bonds = bonds + 2 * _row_words;
+
+  fill_bonds(rng, k_bonds, i, j, bond_direction::k);
+  fill_bonds(rng, j_bonds, i, j, bond_direction::j);
+  fill_bonds(rng, i_bonds, i, j, bond_direction::i);
+
+  k_bonds[0] &= ~uint64_t(1);
+  for_each_set_bit(k_bonds, _row_words, [&](int k) { this->merge_concurrent({i, j, k - 1}, {i, j, k}); });
+
+  if (j > 0)
+  {
+    for_each_set_bit(j_bonds, _row_words, [&](int k) { this->merge_concurrent({i, j - 1, k}, {i, j, k}); });
+  }
+  if (i > 0)
+  {
+    for_each_set_bit(i_bonds, _row_words, [&](int k) { this->merge_concurrent({i - 1, j, k}, {i, j, k}); });
+  }
+}
+
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::generate_slab(int start_i, int end_i)
+{
+  scoped_phase profile(phase::generate_slab);
   pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
 
-  std::tuple<int, int, int> new_node;
+  std::vector<uint64_t> bonds(3 * _row_words);
 
-  for (std::get<0>(new_node) = start_i; std::get<0>(new_node) < end_i; ++std::get<0>(new_node))
+  for (int i = start_i; i < end_i; ++i)
   {
-    for (std::get<1>(new_node) = 0; std::get<1>(new_node) < _cube_size; ++std::get<1>(new_node))
+    for (int j = 0; j < _cube_size; ++j)
     {
-      for (std::get<2>(new_node) = 0; std::get<2>(new_node) < _cube_size; ++std::get<2>(new_node))
-      {
-        // Make set and merge with previous (up to three) if there is an edge between them
-        this->make_set(new_node);
-
-        // Do not make this a loop as no need to construct nodes if rng() >= _bound
-        if (rng() < _bound)
-        {
-          cubic_bond_percolation::merge({std::get<0>(new_node), std::get<1>(new_node), std::max(std::get<2>(new_node) - 1, 0)}, new_node);
-        }
-        if (rng() < _bound)
-        {
-          cubic_bond_percolation::merge({std::get<0>(new_node), std::max(std::get<1>(new_node) - 1, 0), std::get<2>(new_node)}, new_node);
-        }
-        if (rng() < _bound)
-        {
-          cubic_bond_percolation::merge({std::max(std::get<0>(new_node) - 1, start_i), std::get<1>(new_node), std::get<2>(new_node)}, new_node);
-        }
-      }
+      generate_row(rng, bonds.data(), i, j, start_i);
     }
   }
 
   return;
 }
 
-void cubic_bond_percolation::merge_clusters_slices(int i)
+/*
+Counter-based mode: the bonds of every row of sites (i, j, *) in every direction are drawn from their own Philox stream, keyed by
+(campaign_seed, simulation_id), so any bond can be regenerated on demand, and a configuration is the same whatever the thread count,
+generation mode or layout. run_simulations moves on to the next simulation id after each simulation.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::set_seed(uint64_t campaign_seed, uint64_t simulation_id)
 {
-  pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+  _counter_key = philox4x64::key{campaign_seed, simulation_id};
+}
 
-  for (int j = 0; j < _cube_size; ++j)
+// Whether the bond from site to its previous neighbour in direction is open, in counter-based mode
+template <typename node_type, typename layout_type>
+bool cubic_bond_percolation<node_type, layout_type>::bond_open(const std::tuple<int, int, int>& site, bond_direction direction) const
+{
+  if (!_counter_key)
   {
-    for (int k = 0; k < _cube_size; ++k)
-    {
-      // Make set and merge with previous (up to three) if there is an edge between them
-      std::tuple<int, int, int> node1(i, j, k);
-      std::tuple<int, int, int> node2(i - 1, j, k);
+    throw std::logic_error("Bonds can only be regenerated in counter-based mode, see set_seed");
+  }
 
-      if (rng() < _bound)
-      {
-        cubic_bond_percolation::merge(node1, node2);
-      }
-    }
+  const auto [i, j, k] = site;
+  std::vector<uint64_t> bonds(_row_words);
+  philox_stream stream(*_counter_key, row_stream(i, j), static_cast<uint64_t>(direction));
+  _sampler.fill(stream, bonds.data(), _cube_size);
+
+  return (bonds[k / 64] >> (k % 64)) & 1;
+}
+
+// Thread pool with num_threads threads, created on first use and kept for later simulations
+template <typename node_type, typename layout_type>
+thread_pool& cubic_bond_percolation<node_type, layout_type>::pool(uint8_t num_threads)
+{
+  if (!_pool || _pool->num_threads() != std::max<uint8_t>(num_threads, 1) || _pool->affinity() != _affinity)
+  {
+    _pool.reset(); // First, so that the old pool gives this thread back its own affinity before the new one saves it
+    _pool = std::make_unique<thread_pool>(num_threads, _affinity);
   }
+  return *_pool;
+}
 
-  // std::println("Finished merging clusters for i={}", i);
+/*
+Make sets for the row of sites (i, j, *), then merge each with the previous site in every direction if the bond between them is
+open. Bonds are drawn a whole row at a time as bit masks, so only the open ones are visited. Bonds in the first direction are only
+followed for i > start_i: those leaving the slab are drawn by merge_clusters_slices.
+*/
+template <typename node_type, typename layout_type>
+template <typename engine>
+force_inline void cubic_bond_percolation<node_type, layout_type>::generate_row(engine& rng, uint64_t* bonds, int i, int j, int start_i)
+{
+  for (int k = 0; k < _cube_size; ++k)
+  {
+    this->make_set({i, j, k});
+  }
 
-  return;
+  uint64_t* const k_bonds = bonds;
+  uint64_t* const j_bonds = bonds + _row_words;
+  uint64_t* const i_bonds = bonds + 2 * _row_words;
+
+  fill_bonds(rng, k_bonds, i, j, bond_direction::k);
+  fill_bonds(rng, j_bonds, i, j, bond_direction::j);
+  fill_bonds(rng, i_bonds, i, j, bond_direction::i);
+
+  k_bonds[0] &= ~uint64_t(1); // No bond before the first site of the row
+  for_each_set_bit(k_bonds, _row_words, [&](int k) { this->merge({i, j, k - 1}, {i, j, k}); });
+
+  if (j > 0)
+  {
+    for_each_set_bit(j_bonds, _row_words, [&](int k) { this->merge({i, j - 1, k}, {i, j, k}); });
+  }
+  if (i > start_i)
+  {
+    for_each_set_bit(i_bonds, _row_words, [&](int k) { this->merge({i - 1, j, k}, {i, j, k}); });
+  }
 }
 
-void cubic_bond_percolation::generate_clusters()
+/*
+Merge planes i - 1 and i along every open bond between them, in two phases. First the plane is split into tiles of rows, and for
+each tile a task draws the bonds and looks up the roots at both ends of every open bond without modifying the forest, so the tiles
+(and their long find paths) can be done in parallel. Then the much shorter list of distinct root pairs is merged serially, where
+every find starts at an old root and so only takes a step or two.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::merge_clusters_slices(int i, int level)
 {
-  std::tuple<int, int, int> new_node;
+  thread_pool& threads = *_pool;
+  const size_t num_tiles = std::min<size_t>(_cube_size, 4 * threads.num_threads());
 
-  std::array<std::tuple<int, int, int>, 3> previous_nodes;
+  std::vector<std::vector<std::pair<size_t, size_t>>> root_pairs(num_tiles);
+  task_group tiles;
 
-  for (std::get<0>(new_node) = 0; std::get<0>(new_node) < _cube_size; ++std::get<0>(new_node))
+  for (size_t tile = 0; tile < num_tiles; ++tile)
   {
-    for (std::get<1>(new_node) = 0; std::get<1>(new_node) < _cube_size; ++std::get<1>(new_node))
+    threads.submit(tiles,
+                   [&, tile]()
+                   {
+                     scoped_phase profile(phase::merge_find, level);
+                     pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+                     std::vector<uint64_t> bonds(_row_words);
+                     std::vector<std::pair<size_t, size_t>>& pairs = root_pairs[tile];
+
+                     for (int j = tile * _cube_size / num_tiles; j < (tile + 1) * _cube_size / num_tiles; ++j)
+                     {
+                       fill_bonds(rng, bonds.data(), i, j, bond_direction::i);
+                       for_each_set_bit(bonds.data(), _row_words,
+                                        [&](int k)
+                                        {
+                                          const size_t root1 = this->find_root_const(get_index({i, j, k}));
+                                          const size_t root2 = this->find_root_const(get_index({i - 1, j, k}));
+
+                                          // Neighbouring bonds usually join the same pair of clusters
+                                          if (root1 != root2 && (pairs.empty() || pairs.back() != std::pair(root1, root2)))
+                                          {
+                                            pairs.emplace_back(root1, root2);
+                                          }
+                                        });
+                     }
+                   });
+  }
+  threads.wait(tiles);
+
+  scoped_phase profile(phase::merge_union, level);
+  for (const auto& pairs : root_pairs)
+  {
+    for (auto [root1, root2] : pairs)
     {
-      for (std::get<2>(new_node) = 0; std::get<2>(new_node) < _cube_size; ++std::get<2>(new_node))
-      {
-        // Make set and merge with previous (up to three) if there is an edge between them
-        this->make_set(new_node);
+      this->merge_indices(root1, root2);
+    }
+  }
 
-        previous_nodes[0] = {std::get<0>(new_node), std::get<1>(new_node), std::max(std::get<2>(new_node) - 1, 0)};
-        previous_nodes[1] = {std::get<0>(new_node), std::max(std::get<1>(new_node) - 1, 0), std::get<2>(new_node)};
-        previous_nodes[2] = {std::max(std::get<0>(new_node) - 1, 0), std::get<1>(new_node), std::get<2>(new_node)};
+  return;
+}
 
-        for (const auto& node : previous_nodes)
-        {
-          if (_rng() < _bound)
-          {
-            cubic_bond_percolation::merge(node, new_node);
-          }
-        }
-      }
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::generate_clusters()
+{
+  std::vector<uint64_t> bonds(3 * _row_words);
+
+  for (int i = 0; i < _cube_size; ++i)
+  {
+    for (int j = 0; j < _cube_size; ++j)
+    {
+      generate_row(_rng, bonds.data(), i, j, 0);
     }
   }
 
   return;
 }
 
-void cubic_bond_percolation::plot_clusters(uint32_t min_cluster_size, size_t max_num_clusters, const std::string& image_filename) const
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::plot_clusters(uint32_t min_cluster_size, size_t max_num_clusters,
+                                                      const std::string& image_filename) const
 {
   max_num_clusters = std::min(colour_names.size(), max_num_clusters);
-  _gp << "set title tc rgb 'grey40' 'Percolation, p=" << std::setprecision(8) << _probability << " Cube size=" << _cube_size << "'" << std::endl;
+  Gnuplot& gp = plot();
+  gp << "set title tc rgb 'grey40' 'Percolation, p=" << std::setprecision(8) << _probability << " Cube size=" << _cube_size << "'" << std::endl;
 
-  const auto largest_clusters = this->get_clusters_sorted(min_cluster_size);
-  size_t count = 0;
+  const cluster_list clusters = this->get_clusters_sorted(min_cluster_size, std::max(std::thread::hardware_concurrency(), 1u));
+  const size_t num_clusters = std::min(clusters.size(), max_num_clusters);
 
-  // std::println("Number of clusters of size at least {}: {}", min_cluster_size, largest_clusters.size());
+  // std::println("Number of clusters of size at least {}: {}", min_cluster_size, clusters.size());
 
-  for (auto it = largest_clusters.crbegin(); it != largest_clusters.crend() && count < max_num_clusters; ++it, ++count)
+  for (size_t count = 0; count < num_clusters; ++count)
   {
-    _gp << ((count == 0) ? "splot" : "replot") << _gp.file1d(it->second) << "u 1:2:3:(0.03) with points lc rgb '" << colour_names[count]
-        << "' pt 7 ps variable title 'Cluster " << count + 1 << " (" << it->second.size() << " points)"
-        << ((it->first.size > 0) ? "(terminated)" : "(still growing)") << "'"
-        << ((count == max_num_clusters - 1 || it == --largest_clusters.crend()) ? "; pause mouse close" : "") << std::endl;
+    gp << ((count == 0) ? "splot" : "replot") << gp.file1d(this->get_cluster_elements(clusters, count)) << "u 1:2:3:(0.03) with points lc rgb '"
+       << colour_names[count] << "' pt 7 ps variable title 'Cluster " << count + 1 << " (" << clusters.cluster_size(count) << " points)"
+       << ((clusters.roots[count].size > 0) ? "(terminated)" : "(still growing)") << "'" << ((count == num_clusters - 1) ? "; pause mouse close" : "")
+       << std::endl;
   }
 
   if (image_filename != "")
   {
-    _gp << "set terminal pngcairo size 3000,3000 background rgb \'black\'" << std::endl;
-    _gp << std::format("set output \"images/{}.png\"", image_filename) << std::endl;
-    _gp << "replot" << std::endl;
+    gp << "set terminal pngcairo size 3000,3000 background rgb \'black\'" << std::endl;
+    gp << std::format("set output \"images/{}.png\"", image_filename) << std::endl;
+    gp << "replot" << std::endl;
   }
 }
 
-void cubic_bond_percolation::plot_central_clusters(uint32_t min_cluster_size, size_t central_cube_size, size_t max_num_clusters,
-                                                   const std::string& image_filename) const
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::plot_central_clusters(uint32_t min_cluster_size, size_t central_cube_size, size_t max_num_clusters,
+                                                              const std::string& image_filename) const
 {
   max_num_clusters = std::min(colour_names.size(), max_num_clusters);
 
-  std::tuple<int, int, int> current_node;
-  std::map<node, std::vector<std::tuple<int, int, int>>> clusters;
-
-  // Populate map with all roots of clusters which intersect a central cube
   if (central_cube_size > _cube_size)
   {
     std::println("Central cube larger than simulation");
     return;
   }
 
-  const size_t min_coordinate = (_cube_size - central_cube_size) / 2;
-  const size_t max_coordinate = (_cube_size + central_cube_size) / 2;
-  for (std::get<0>(current_node) = min_coordinate; std::get<0>(current_node) < max_coordinate; ++std::get<0>(current_node))
-  {
-    for (std::get<1>(current_node) = min_coordinate; std::get<1>(current_node) < max_coordinate; ++std::get<1>(current_node))
-    {
-      for (std::get<2>(current_node) = min_coordinate; std::get<2>(current_node) < max_coordinate; ++std::get<2>(current_node))
-      {
-        const size_t index = this->get_index(current_node);
-
-        const node& root = *this->find_const(&this->_forest[index]);
+  const cluster_list clusters = this->get_clusters_sorted(min_cluster_size, std::max(std::thread::hardware_concurrency(), 1u));
+  const std::vector<bool> central_roots = get_central_roots(central_cube_size);
 
-        if (std::abs(root.size) >= min_cluster_size)
-        {
-          if (!clusters.contains(root))
-          {
-            clusters.emplace(root, std::vector<std::tuple<int, int, int>>({this->get_element(index)}));
-          }
-        }
-      }
-    }
-  }
-
-  // Now populate map fully
-  for (std::get<0>(current_node) = 0; std::get<0>(current_node) < _cube_size; ++std::get<0>(current_node))
+  // Largest clusters which intersect the central cube
+  std::vector<size_t> plotted;
+  for (size_t cluster = 0; cluster < clusters.size() && plotted.size() < max_num_clusters; ++cluster)
   {
-    for (std::get<1>(current_node) = 0; std::get<1>(current_node) < _cube_size; ++std::get<1>(current_node))
+    if (central_roots[clusters.roots[cluster].index])
     {
-      for (std::get<2>(current_node) = 0; std::get<2>(current_node) < _cube_size; ++std::get<2>(current_node))
-      {
-        const size_t index = this->get_index(current_node);
-
-        const node& root = *this->find_const(&this->_forest[index]);
-
-        if (std::abs(root.size) >= min_cluster_size)
-        {
-          if (clusters.contains(root))
-          {
-            clusters.at(root).push_back(this->get_element(index));
-          }
-        }
-      }
+      plotted.push_back(cluster);
     }
   }
 
-  _gp << "set title tc rgb 'grey40' 'Percolation, p=" << std::setprecision(8) << _probability << " Cube size=" << _cube_size << "'" << std::endl;
-
-  size_t count = 0;
+  Gnuplot& gp = plot();
+  gp << "set title tc rgb 'grey40' 'Percolation, p=" << std::setprecision(8) << _probability << " Cube size=" << _cube_size << "'" << std::endl;
 
-  // std::println("Number of clusters of size at least {}: {}", min_cluster_size, clusters.size());
+  // std::println("Number of clusters of size at least {}: {}", min_cluster_size, plotted.size());
 
-  for (auto it = clusters.crbegin(); it != clusters.crend() && count < max_num_clusters; ++it, ++count)
+  for (size_t count = 0; count < plotted.size(); ++count)
   {
-    _gp << ((count == 0) ? "splot" : "replot") << _gp.file1d(it->second) << "u 1:2:3:(0.03) with points lc rgb '" << colour_names[count]
-        << "' pt 7 ps variable title 'Cluster " << count + 1 << " (" << it->second.size() << " points)"
-        << ((it->first.size > 0) ? "(terminated)" : "(still growing)") << "'"
-        << ((count == max_num_clusters - 1 || it == --clusters.crend()) ? "; pause mouse close" : "") << std::endl;
+    const size_t cluster = plotted[count];
+    gp << ((count == 0) ? "splot" : "replot") << gp.file1d(this->get_cluster_elements(clusters, cluster)) << "u 1:2:3:(0.03) with points lc rgb '"
+       << colour_names[count] << "' pt 7 ps variable title 'Cluster " << count + 1 << " (" << clusters.cluster_size(cluster) << " points)"
+       << ((clusters.roots[cluster].size > 0) ? "(terminated)" : "(still growing)") << "'" << ((count == plotted.size() - 1) ? "; pause mouse close" : "")
+       << std::endl;
   }
 
   if (image_filename != "")
   {
-    _gp << "set terminal pngcairo size 3000,3000 background rgb \'black\'" << std::endl;
-    _gp << std::format("set output \"images/{}.png\"", image_filename) << std::endl;
-    _gp << "replot" << std::endl;
+    gp << "set terminal pngcairo size 3000,3000 background rgb \'black\'" << std::endl;
+    gp << std::format("set output \"images/{}.png\"", image_filename) << std::endl;
+    gp << "replot" << std::endl;
   }
 }
 
-void cubic_bond_percolation::write_clusters_data(uint32_t min_cluster_size, size_t central_cube_size) const
+// Marks the roots of the clusters which intersect the central cube
+template <typename node_type, typename layout_type>
+std::vector<bool> cubic_bond_percolation<node_type, layout_type>::get_central_roots(size_t central_cube_size) const
 {
-  std::tuple<int, int, int> current_node;
-  std::set<node> clusters;
+  std::vector<bool> central_roots(this->_forest.size(), false);
 
-  // Populate map with all roots of clusters which intersect a central cube
+  const int min_coordinate = (_cube_size - central_cube_size) / 2;
+  const int max_coordinate = (_cube_size + central_cube_size) / 2;
+  for (int i = min_coordinate; i < max_coordinate; ++i)
+  {
+    for (int j = min_coordinate; j < max_coordinate; ++j)
+    {
+      for (int k = min_coordinate; k < max_coordinate; ++k)
+      {
+        central_roots[this->get_root(get_index({i, j, k})).index] = true;
+      }
+    }
+  }
+
+  return central_roots;
+}
+
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::write_clusters_data(uint32_t min_cluster_size, size_t central_cube_size) const
+{
   if (central_cube_size > _cube_size)
   {
     std::println("Central cube larger than simulation");
     return;
   }
 
-  const size_t min_coordinate = (_cube_size - central_cube_size) / 2;
-  const size_t max_coordinate = (_cube_size + central_cube_size) / 2;
-  for (std::get<0>(current_node) = min_coordinate; std::get<0>(current_node) < max_coordinate; ++std::get<0>(current_node))
+  // Roots of all clusters which intersect the central cube, largest first
+  const std::vector<bool> central_roots = get_central_roots(central_cube_size);
+  std::vector<cluster_root> clusters = this->get_roots_sorted(min_cluster_size);
+  std::erase_if(clusters, [&](const cluster_root& root) { return !central_roots[root.index]; });
+  if (clusters.empty())
   {
-    for (std::get<1>(current_node) = min_coordinate; std::get<1>(current_node) < max_coordinate; ++std::get<1>(current_node))
-    {
-      for (std::get<2>(current_node) = min_coordinate; std::get<2>(current_node) < max_coordinate; ++std::get<2>(current_node))
-      {
-        const size_t index = this->get_index(current_node);
-
-        const node& root = *this->find_const(&this->_forest[index]);
-
-        if (std::abs(root.size) >= min_cluster_size)
-        {
-          if (!clusters.contains(root))
-          {
-            clusters.emplace(root);
-          }
-        }
-      }
-    }
+    return;
   }
 
-  // TODO: ensure directory exists
-  std::ofstream data_file(
-      std::format("src/analyse_data/data/test/cubic_bond_percolation_p_{:.10f}_centre_{}_size_{}.csv", _probability, central_cube_size, _cube_size));
+  const std::filesystem::path data_path =
+      std::format("src/analyse_data/data/test/cubic_bond_percolation_p_{:.10f}_centre_{}_size_{}.csv", _probability, central_cube_size, _cube_size);
+  std::filesystem::create_directories(data_path.parent_path());
+  std::ofstream data_file(data_path);
 
   data_file << "probability, central cube size, simulation size, number of simulations\n";
   data_file << std::format("{:.10f}, {}, {}, 1\n", _probability, central_cube_size, _cube_size);
   data_file << "\nsize,number terminated,number still growing\n";
 
-  std::array<size_t, 3> line = {static_cast<size_t>(std::abs(clusters.crbegin()->size)), 0, 0};
+  std::array<size_t, 3> line = {static_cast<size_t>(std::abs(clusters.front().size)), 0, 0};
 
-  for (auto it = clusters.crbegin(); it != clusters.crend(); ++it)
+  for (auto it = clusters.cbegin(); it != clusters.cend(); ++it)
   {
     if (std::abs(it->size) == line[0])
     {
@@ -361,10 +561,51 @@ void cubic_bond_percolation::write_clusters_data(uint32_t min_cluster_size, size
   data_file << std::format("{},{},{}\n", line[0], line[1], line[2]);
 }
 
-void cubic_bond_percolation::run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size,
-                                             uint8_t max_num_threads)
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size,
+                                                        uint8_t num_threads)
 {
   std::println("Running {} simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+
+  if (central_cube_size > _cube_size)
+  {
+    std::println("Central cube larger than simulation");
+    return;
+  }
+
+  const results_header header =
+      make_results_header("cubic_bond_percolation", _probability, central_cube_size, _cube_size, _counter_key ? (*_counter_key)[0] : 0);
+  const std::filesystem::path path = results_path(folder_name, header);
+  const cluster_histogram results = run_checkpointed_simulations(
+      path, header, num_simulations, _rng,
+      [&](uint32_t simulation_count)
+      {
+        phase_profiler::instance().set_simulation(simulation_count);
+        generate_clusters_parallel(num_threads);
+        return count_clusters_parallel(num_threads, (_cube_size - central_cube_size) / 2, (_cube_size + central_cube_size) / 2, central_cube_size);
+      },
+      _counter_key ? &(*_counter_key)[1] : nullptr);
+
+  // Write out results to file
+  write_histogram_csv(folder_name, "cubic_bond_percolation", _probability, central_cube_size, _cube_size, num_simulations, results);
+
+  std::println("Completed {} simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+}
+
+/*
+Replicas take the probability and bond sampling of this simulation. In counter-based mode simulation n runs on replica key
+(campaign seed, simulation id + n), whichever thread picks it up, so the results are the same as from run_simulations.
+
+Records are appended one at a time under results_mutex, in the order simulations finish, so the run cannot be checkpointed: the
+checkpoint of an earlier run_simulations is discarded instead, so that resuming it does not drop these records. The first error of
+any replica stops the others from starting new simulations and is rethrown once they are joined.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::run_replica_simulations(const std::string& folder_name, uint32_t num_simulations,
+                                                                             size_t central_cube_size, uint8_t num_threads)
+{
+  num_threads = std::clamp<uint32_t>(num_threads, 1, std::max<uint32_t>(num_simulations, 1));
+  std::println("Running {} simulations with size {} for p={} on {} replicas", num_simulations, _cube_size, _probability, num_threads);
   timer tm;
 
   if (central_cube_size > _cube_size)
@@ -373,100 +614,300 @@ void cubic_bond_percolation::run_simulations(const std::string& folder_name, uin
     return;
   }
 
-  std::vector<std::pair<uint64_t, uint64_t>> results;
-  for (uint32_t simulation_count = 0; simulation_count < num_simulations; ++simulation_count)
+  const int min_coordinate = (_cube_size - central_cube_size) / 2;
+  const int max_coordinate = (_cube_size + central_cube_size) / 2;
+
+  const results_header header =
+      make_results_header("cubic_bond_percolation", _probability, central_cube_size, _cube_size, _counter_key ? (*_counter_key)[0] : 0);
+  const std::filesystem::path path = results_path(folder_name, header);
+  results_writer writer(path, header);
+  checkpoint_file::discard(path);
+
+  cluster_histogram results;
+  std::mutex results_mutex;
+  std::exception_ptr error;
+  std::atomic<uint32_t> next_simulation = 0;
+
+  tm.start();
+  std::vector<std::thread> threads;
+  for (uint8_t thread = 0; thread < num_threads; ++thread)
   {
-    std::print("Simulation number: {}", simulation_count);
+    threads.emplace_back(
+        [&]()
+        {
+          try
+          {
+            cubic_bond_percolation replica(_cube_pow, _probability);
+            replica.set_bond_sampling(_sampler.mode());
+
+            for (uint32_t simulation = next_simulation++; simulation < num_simulations; simulation = next_simulation++)
+            {
+              if (_counter_key)
+              {
+                replica.set_seed((*_counter_key)[0], (*_counter_key)[1] + simulation);
+              }
+
+              replica.generate_clusters();
+              const cluster_histogram simulation_results = replica.count_clusters_parallel_thread(min_coordinate, max_coordinate, central_cube_size);
+
+              std::lock_guard lock(results_mutex);
+              writer.append(_counter_key ? (*_counter_key)[1] + simulation : simulation, simulation_results);
+              merge_histograms(results, simulation_results);
+            }
+          }
+          catch (...)
+          {
+            next_simulation = num_simulations;
+            std::lock_guard lock(results_mutex);
+            if (!error)
+            {
+              error = std::current_exception();
+            }
+          }
+        });
+  }
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+
+  if (_counter_key)
+  {
+    (*_counter_key)[1] += num_simulations;
+  }
+
+  tm.stop();
+  std::println("Completed {} simulations with size {} for p={} in {} ms", num_simulations, _cube_size, _probability, tm.get_ms());
+
+  write_histogram_csv(folder_name, "cubic_bond_percolation", _probability, central_cube_size, _cube_size, num_simulations, results);
+}
+
+/*
+Each sweep opens every bond with activation time below min_p in bulk, then adds those in [min_p, max_p) one at a time in order of
+activation time, see newman_ziff.h. The window should extend several binomial widths, sqrt(M p (1 - p)) / M for M = 3 L^2 (L - 1)
+bonds, beyond the probabilities asked for: the binomial weight it covers is written out with the results.
+Activation times come from the counter-based streams, one engine call per bond, with a random campaign seed unless set_seed was
+called.
+*/
+template <typename node_type, typename layout_type>
+void cubic_bond_percolation<node_type, layout_type>::run_newman_ziff(const std::string& folder_name, uint32_t num_sweeps, double min_p,
+                                                                     double max_p, const std::vector<double>& probabilities,
+                                                                     size_t central_cube_size, uint8_t num_threads)
+{
+  std::println("Running {} Newman-Ziff sweeps with size {} for p in [{}, {})", num_sweeps, _cube_size, min_p, max_p);
+  timer tm;
+
+  if (central_cube_size > _cube_size)
+  {
+    std::println("Central cube larger than simulation");
+    return;
+  }
+
+  const double previous_probability = _probability;
+  const bond_sampling previous_mode = _sampler.mode();
+  const bool seeded = _counter_key.has_value();
+  if (!seeded)
+  {
+    std::random_device device;
+    set_seed(static_cast<uint64_t>(device()) << 32 | device());
+  }
+  set_bond_sampling(bond_sampling::per_bond);
+
+  const uint64_t num_bonds = 3 * static_cast<uint64_t>(_cube_size) * _cube_size * (_cube_size - 1);
+  const uint64_t min_bound = std::numeric_limits<uint64_t>::max() * min_p;
+  const uint64_t max_bound = std::numeric_limits<uint64_t>::max() * max_p;
+  const size_t min_coordinate = (_cube_size - central_cube_size) / 2;
+  const size_t max_coordinate = (_cube_size + central_cube_size) / 2;
+
+  std::vector<newman_ziff_estimate> results;
+  for (const double probability : probabilities)
+  {
+    results.push_back({probability, 0, 0, 0, {}});
+  }
+
+  for (uint32_t sweep = 0; sweep < num_sweeps; ++sweep)
+  {
+    std::print("Sweep number: {}", sweep);
     tm.restart();
-    // Run simulation
-    generate_clusters_parallel(max_num_threads);
 
-    auto new_results = count_clusters_parallel_recursive(max_num_threads, (_cube_size - central_cube_size) / 2, (_cube_size + central_cube_size) / 2,
-                                                         central_cube_size);
+    set_probability(min_p);
+    generate_clusters_parallel(num_threads);
+
+    auto [bulk_bonds, window_bonds] = collect_window_bonds(min_bound, max_bound, num_threads);
+    std::sort(window_bonds.begin(), window_bonds.end(),
+              [](const newman_ziff_bond& lhs, const newman_ziff_bond& rhs) { return lhs.activation < rhs.activation; });
+
+    // State after the bulk bonds
+    const cluster_histogram histogram = count_clusters_parallel(num_threads, min_coordinate, max_coordinate, central_cube_size);
+
+    std::unordered_map<size_t, uint64_t> central_sites;
+    for (int i = min_coordinate; i < max_coordinate; ++i)
+    {
+      for (int j = min_coordinate; j < max_coordinate; ++j)
+      {
+        for (int k = min_coordinate; k < max_coordinate; ++k)
+        {
+          ++central_sites[this->find_cluster(get_index({i, j, k})).index];
+        }
+      }
+    }
+
+    uint64_t largest_cluster = 0;
+    uint64_t boundary_clusters = 0;
+    for (size_t index = 0; index < this->_forest.size(); ++index)
+    {
+      if (this->_forest[index].is_root(index))
+      {
+        const int64_t size = this->cluster_size(index);
+        largest_cluster = std::max<uint64_t>(largest_cluster, std::abs(size));
+        boundary_clusters += size < 0;
+      }
+    }
 
-    if (new_results.size() > results.size())
+    newman_ziff_sweep nz(bulk_bonds, histogram, largest_cluster, boundary_clusters, std::move(central_sites));
+    for (const newman_ziff_bond& bond : window_bonds)
     {
-      results.resize(new_results.size(), std::pair<uint64_t, uint64_t>(0, 0));
+      nz.add_bond(*this, bond.index1, bond.index2);
     }
 
-    for (size_t i = 0; i < new_results.size(); ++i)
+    for (size_t p_index = 0; p_index < probabilities.size(); ++p_index)
     {
-      results[i].first += new_results[i].first;
-      results[i].second += new_results[i].second;
+      merge_estimates(results[p_index], nz.canonical(probabilities[p_index], num_bonds));
     }
 
+    ++(*_counter_key)[1];
+
     tm.stop();
-    std::print(" finished in {} ms\n", tm.get_ms());
+    std::print(" finished in {} ms, {} bonds in the window\n", tm.get_ms(), window_bonds.size());
   }
 
-  // Write out results to file
-  std::filesystem::path results_path = std::format("src/analyse_data/data/{}/cubic_bond_percolation_p_{:.10f}_centre_{}_size_{}_num_{}.csv",
-                                                   folder_name, _probability, central_cube_size, _cube_size, num_simulations);
-  std::filesystem::create_directory(results_path.parent_path());
-  std::ofstream data_file(results_path);
-
-  data_file << "probability, central cube size, simulation size, number of simulations\n";
-  data_file << std::format("{:.10f}, {}, {}, {}\n", _probability, central_cube_size, _cube_size, num_simulations);
-  data_file << "\nstart size,number terminated,number still growing\n";
+  for (const newman_ziff_estimate& estimate : results)
+  {
+    write_newman_ziff_csv(folder_name, "cubic_bond_percolation", central_cube_size, _cube_size, num_sweeps, estimate);
+  }
 
-  for (size_t bucket = 0; bucket < results.size(); ++bucket)
+  if (!seeded)
   {
-    data_file << std::format("{}, {}, {}\n", bucket + 1, results[bucket].first, results[bucket].second);
+    _counter_key.reset();
   }
+  set_bond_sampling(previous_mode);
+  set_probability(previous_probability);
 
-  std::println("Completed {} simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+  std::println("Completed {} Newman-Ziff sweeps with size {} for {} probabilities", num_sweeps, _cube_size, probabilities.size());
 }
 
-std::vector<std::pair<uint64_t, uint64_t>> cubic_bond_percolation::count_clusters_parallel_recursive(uint8_t max_num_threads, int start_i, int end_i,
-                                                                                                     size_t central_cube_size) const
+// Number of bonds with activation time below min_bound, and the bonds with activation time in [min_bound, max_bound)
+template <typename node_type, typename layout_type>
+std::pair<uint64_t, std::vector<newman_ziff_bond>>
+cubic_bond_percolation<node_type, layout_type>::collect_window_bonds(uint64_t min_bound, uint64_t max_bound, uint8_t num_threads)
 {
-  std::vector<std::pair<uint64_t, uint64_t>> results1;
-  std::vector<std::pair<uint64_t, uint64_t>> results2;
+  thread_pool& threads = pool(num_threads);
+  const size_t num_slabs = std::min<size_t>(_cube_size, 4 * threads.num_threads());
 
-  int middle_i = (start_i + end_i) / 2;
+  std::vector<uint64_t> bulk_bonds(num_slabs, 0);
+  std::vector<std::vector<newman_ziff_bond>> window_bonds(num_slabs);
+  task_group slabs;
 
-  if (std::min(middle_i - start_i, end_i - middle_i) >= 2 * central_cube_size / max_num_threads)
+  for (size_t slab = 0; slab < num_slabs; ++slab)
   {
-
-    // Split each in half again and recurse, joining up afterwards
-    std::future<std::vector<std::pair<uint64_t, uint64_t>>> promise1 = std::async(
-        std::launch::async, &cubic_bond_percolation::count_clusters_parallel_recursive, this, max_num_threads, start_i, middle_i, central_cube_size);
-    std::future<std::vector<std::pair<uint64_t, uint64_t>>> promise2 = std::async(
-        std::launch::async, &cubic_bond_percolation::count_clusters_parallel_recursive, this, max_num_threads, middle_i, end_i, central_cube_size);
-
-    results1 = promise1.get();
-    results2 = promise2.get();
+    threads.submit(slabs,
+                   [&, slab]()
+                   {
+                     for (int i = slab * _cube_size / num_slabs; i < (slab + 1) * _cube_size / num_slabs; ++i)
+                     {
+                       for (int j = 0; j < _cube_size; ++j)
+                       {
+                         for (const bond_direction direction : {bond_direction::k, bond_direction::j, bond_direction::i})
+                         {
+                           // Same engine calls as the per_bond sampler makes for the row
+                           philox_stream stream(*_counter_key, row_stream(i, j), static_cast<uint64_t>(direction));
+                           for (int k = 0; k < _cube_size; ++k)
+                           {
+                             const uint64_t activation = stream();
+
+                             std::tuple<int, int, int> neighbour = {i, j, k - 1};
+                             if (direction == bond_direction::j)
+                             {
+                               neighbour = {i, j - 1, k};
+                             }
+                             else if (direction == bond_direction::i)
+                             {
+                               neighbour = {i - 1, j, k};
+                             }
+
+                             const auto [ni, nj, nk] = neighbour;
+                             if (ni < 0 || nj < 0 || nk < 0)
+                             {
+                               continue;
+                             }
+
+                             if (activation < min_bound)
+                             {
+                               ++bulk_bonds[slab];
+                             }
+                             else if (activation < max_bound)
+                             {
+                               window_bonds[slab].push_back({activation, get_index({i, j, k}), get_index(neighbour)});
+                             }
+                           }
+                         }
+                       }
+                     }
+                   });
   }
-  else
-  {
-    std::future<std::vector<std::pair<uint64_t, uint64_t>>> promise1 =
-        std::async(std::launch::async, &cubic_bond_percolation::count_clusters_parallel_thread, this, start_i, middle_i, central_cube_size);
-    std::future<std::vector<std::pair<uint64_t, uint64_t>>> promise2 =
-        std::async(std::launch::async, &cubic_bond_percolation::count_clusters_parallel_thread, this, middle_i, end_i, central_cube_size);
+  threads.wait(slabs);
 
-    results1 = promise1.get();
-    results2 = promise2.get();
+  std::pair<uint64_t, std::vector<newman_ziff_bond>> result;
+  for (size_t slab = 0; slab < num_slabs; ++slab)
+  {
+    result.first += bulk_bonds[slab];
+    result.second.insert(result.second.end(), window_bonds[slab].begin(), window_bonds[slab].end());
   }
+  return result;
+}
+
+// Count the central cube in chunks of planes, one task each
+template <typename node_type, typename layout_type>
+cluster_histogram cubic_bond_percolation<node_type, layout_type>::count_clusters_parallel(uint8_t num_threads, int start_i, int end_i,
+                                                                                         size_t central_cube_size)
+{
+  thread_pool& threads = pool(num_threads);
+  const size_t num_chunks = std::min<size_t>(end_i - start_i, 4 * threads.num_threads());
+
+  std::vector<cluster_histogram> chunk_results(num_chunks);
+  task_group group;
 
-  // Merge results and return
-  if (results2.size() > results1.size())
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk)
   {
-    results1.resize(results2.size(), std::pair<uint64_t, uint64_t>(0, 0));
+    const int chunk_start = start_i + chunk * (end_i - start_i) / num_chunks;
+    threads.submit_to(plane_owner(chunk_start, threads.num_threads()), group,
+                      [&, chunk, chunk_start]()
+                      {
+                        chunk_results[chunk] = count_clusters_parallel_thread(
+                            chunk_start, start_i + (chunk + 1) * (end_i - start_i) / num_chunks, central_cube_size);
+                      });
   }
+  threads.wait(group);
 
-  for (size_t i = 0; i < results2.size(); ++i)
+  cluster_histogram results;
+  for (const cluster_histogram& chunk_result : chunk_results)
   {
-    results1[i].first += results2[i].first;
-    results1[i].second += results2[i].second;
+    merge_histograms(results, chunk_result);
   }
 
-  return results1;
+  return results;
 }
 
-std::vector<std::pair<uint64_t, uint64_t>> cubic_bond_percolation::count_clusters_parallel_thread(int start_i, int end_i,
-                                                                                                  size_t central_cube_size) const
+template <typename node_type, typename layout_type>
+cluster_histogram cubic_bond_percolation<node_type, layout_type>::count_clusters_parallel_thread(int start_i, int end_i,
+                                                                                                size_t central_cube_size) const
 {
-  std::vector<std::pair<uint64_t, uint64_t>> results;
+  scoped_phase profile(phase::count_clusters);
+  cluster_histogram results;
 
   std::tuple<int, int, int> current_node;
   // Populate map with all roots of clusters which intersect a central cube
@@ -480,22 +921,7 @@ std::vector<std::pair<uint64_t, uint64_t>> cubic_bond_percolation::count_cluster
       {
         const size_t index = this->get_index(current_node);
 
-        const node& root = *this->find_const(&this->_forest[index]);
-
-        uint32_t bucket = std::bit_width(static_cast<uint32_t>(std::abs(root.size))) - 1;
-        if (results.size() < bucket + 1)
-        {
-          results.resize(bucket + 1, std::pair<uint64_t, uint64_t>(0, 0));
-        }
-
-        if (root.size > 0)
-        {
-          ++results[bucket].first;
-        }
-        else
-        {
-          ++results[bucket].second;
-        }
+        add_to_histogram(results, this->get_root(index).size, 1);
       }
     }
   }
@@ -503,30 +929,18 @@ std::vector<std::pair<uint64_t, uint64_t>> cubic_bond_percolation::count_cluster
   return results;
 }
 
-int main()
-{
-  cubic_bond_percolation perc(10, 0.2488);
-
-  // TODO: plots show size as being one too large.
-
-  for (auto [probability, count] = std::tuple<double, size_t>{0.24878, 0}; count < 8; ++count, probability += 0.00001)
-  {
-    std::println("Loop {}: Generating clusters for probability={:.10f}", count, probability);
-    perc.set_probability(probability);
-    perc.run_simulations("test4", 100, 128, 8);
-
-    // perc.generate_clusters_parallel(4);
-    // perc.write_clusters_data(1, 64);
-  }
-
-  /* perc.generate_clusters_parallel(4);
-  perc.plot_clusters(10000, 10, "plot6"); */
-
-  return 0;
-}
+template class cubic_bond_percolation<packed_node, row_major_layout>;
+template class cubic_bond_percolation<packed_node, morton_layout>;
+template class cubic_bond_percolation<packed_node, tiled_layout<>>;
+template class cubic_bond_percolation<compact_node<uint32_t>, row_major_layout>;
+template class cubic_bond_percolation<compact_node<uint32_t>, morton_layout>;
+template class cubic_bond_percolation<compact_node<uint32_t>, tiled_layout<>>;
+template class cubic_bond_percolation<compact_node<uint64_t>, row_major_layout>;
+template class cubic_bond_percolation<compact_node<uint64_t>, morton_layout>;
+template class cubic_bond_percolation<compact_node<uint64_t>, tiled_layout<>>;
 
 /*
 If we want to use mmap, it is much too slow to use directly due to the somewhat random access pattern of the disjoint set forest.
-Perhaps it would be possible to run the simulation for each slice in memory. Then we could mmap these vectors to chunks of a
-larger file, before finally merging these chunks to get the final result - massively reducing thrashing.
+Instead out_of_core_cubic_bond_percolation runs the simulation for each slice in memory, writes these to chunks of a larger mmap'd
+file, and finally merges the chunks along their faces - massively reducing thrashing.
 */
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <optional>
+#include <print>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <stdint.h>
+
+#include "hypercubic_bond_percolation.h"
+
+#include "checkpoint.h"
+#include "cluster_histogram.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "percolation.h"
+#include "phase_profiler.h"
+#include "results_file.h"
+#include "timer.h"
+
+template <uint8_t dimension, uint8_t size_pow>
+hypercubic_bond_percolation<dimension, size_pow>::hypercubic_bond_percolation(double p, page_policy pages)
+    : basic_percolation<hypercubic_bond_percolation<dimension, size_pow>, site, compact_node_for<uint64_t(1) << (dimension * size_pow)>>(num_sites,
+                                                                                                                                    pages),
+      _probability(p), _sampler(p), _rng(pcg_extras::seed_seq_from<std::random_device>{})
+{
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::set_probability(double p)
+{
+  _probability = p;
+  _sampler.set_probability(p);
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::set_bond_sampling(bond_sampling mode)
+{
+  _sampler.set_mode(mode);
+}
+
+// Displacements and wrapping masks take another 4 * dimension + 1 bytes per site, allocated when first needed
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::set_boundary_condition(boundary_condition boundary)
+{
+  _boundary = boundary;
+  if (_boundary == boundary_condition::periodic && !_displacements)
+  {
+    _displacements = std::make_unique<huge_page_vector<displacement>>(num_sites, this->_forest.policy());
+    _wrapping = std::make_unique<huge_page_vector<uint8_t>>(num_sites, this->_forest.policy());
+  }
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+std::string hypercubic_bond_percolation<dimension, size_pow>::model_name() const
+{
+  return std::format("hypercubic_{}d_{}bond_percolation", dimension, _boundary == boundary_condition::periodic ? "periodic_" : "");
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::generate_clusters()
+{
+  if (_boundary == boundary_condition::periodic)
+  {
+    generate_slab<true>(_rng, 0, size);
+    merge_plane_periodic(_rng, 0);
+  }
+  else
+  {
+    generate_slab<false>(_rng, 0, size);
+  }
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+template <bool periodic, typename engine>
+void hypercubic_bond_percolation<dimension, size_pow>::generate_slab(engine& rng, int start_0, int end_0)
+{
+  constexpr size_t rows_per_plane = num_rows / size;
+  std::vector<uint64_t> bonds(row_words);
+
+  for (size_t row = start_0 * rows_per_plane; row < end_0 * rows_per_plane; ++row)
+  {
+    generate_row<periodic>(rng, bonds.data(), row, start_0);
+  }
+}
+
+// Merge plane with the plane before it, plane size - 1 for plane 0, along the open bonds between them, serially
+template <uint8_t dimension, uint8_t size_pow>
+template <typename engine>
+void hypercubic_bond_percolation<dimension, size_pow>::merge_plane_periodic(engine& rng, int plane)
+{
+  constexpr size_t rows_per_plane = num_rows / size;
+  const size_t previous_plane = plane == 0 ? size - 1 : plane - 1;
+  std::vector<uint64_t> bonds(row_words);
+
+  for (size_t row = plane * rows_per_plane; row < (plane + 1) * rows_per_plane; ++row)
+  {
+    const size_t first = row << size_pow;
+    const size_t previous_first = first - plane * strides[0] + previous_plane * strides[0];
+    _sampler.fill(rng, bonds.data(), size);
+    for_each_set_bit(bonds.data(), row_words, [&](size_t k) { merge_periodic<0>(previous_first + k, first + k); });
+  }
+}
+
+/*
+The hypercube is split into slabs along the first coordinate, several per thread so that the pool can balance uneven slabs, which
+are generated as independent tasks. The bonds between slabs are then followed as in cubic_bond_percolation::merge_clusters_slices,
+all boundaries at once: tasks over tiles of the boundary planes look up the roots at both ends of every open bond, and the distinct
+root pairs are merged serially.
+With periodic boundaries the bonds between slabs, and those wrapping from the last plane to the first, are merged serially with
+their displacements instead, a fraction num_slabs / size of all bonds along the first coordinate.
+*/
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::generate_clusters_parallel(uint8_t num_threads)
+{
+  constexpr size_t rows_per_plane = num_rows / size;
+
+  thread_pool& threads = pool(num_threads);
+  const size_t num_slabs = std::min<size_t>(size, 4 * threads.num_threads());
+  const auto slab_start = [&](size_t slab) { return static_cast<int>(slab * size / num_slabs); };
+
+  const bool periodic = _boundary == boundary_condition::periodic;
+
+  task_group slabs;
+  for (size_t slab = 0; slab < num_slabs; ++slab)
+  {
+    threads.submit(slabs,
+                   [&, slab]()
+                   {
+                     scoped_phase profile(phase::generate_slab);
+                     pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+                     if (periodic)
+                     {
+                       generate_slab<true>(rng, slab_start(slab), slab_start(slab + 1));
+                     }
+                     else
+                     {
+                       generate_slab<false>(rng, slab_start(slab), slab_start(slab + 1));
+                     }
+                   });
+  }
+  threads.wait(slabs);
+
+  if (periodic)
+  {
+    scoped_phase profile(phase::merge_union);
+    for (size_t slab = 0; slab < num_slabs; ++slab)
+    {
+      merge_plane_periodic(_rng, slab_start(slab));
+    }
+    return;
+  }
+
+  const size_t num_tiles = std::min<size_t>(rows_per_plane, 4 * threads.num_threads());
+  std::vector<std::vector<std::pair<size_t, size_t>>> root_pairs((num_slabs - 1) * num_tiles);
+  task_group tiles;
+
+  for (size_t slab = 1; slab < num_slabs; ++slab)
+  {
+    for (size_t tile = 0; tile < num_tiles; ++tile)
+    {
+      threads.submit(tiles,
+                     [&, slab, tile]()
+                     {
+                       const size_t plane_row = slab_start(slab) * rows_per_plane;
+                       root_pairs[(slab - 1) * num_tiles + tile] =
+                           find_slab_root_pairs(slab_start(slab), plane_row + tile * rows_per_plane / num_tiles,
+                                                plane_row + (tile + 1) * rows_per_plane / num_tiles);
+                     });
+    }
+  }
+  threads.wait(tiles);
+
+  scoped_phase profile(phase::merge_union);
+  for (const auto& pairs : root_pairs)
+  {
+    for (auto [root1, root2] : pairs)
+    {
+      this->merge_indices(root1, root2);
+    }
+  }
+}
+
+// Roots at both ends of the open bonds from rows [first_row, end_row) of plane back to the plane before, without modifying the forest
+template <uint8_t dimension, uint8_t size_pow>
+std::vector<std::pair<size_t, size_t>> hypercubic_bond_percolation<dimension, size_pow>::find_slab_root_pairs(int plane, size_t first_row,
+                                                                                                              size_t end_row) const
+{
+  scoped_phase profile(phase::merge_find);
+  pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+  std::vector<uint64_t> bonds(row_words);
+  std::vector<std::pair<size_t, size_t>> pairs;
+
+  for (size_t row = first_row; row < end_row; ++row)
+  {
+    const size_t first = row << size_pow;
+    _sampler.fill(rng, bonds.data(), size);
+    for_each_set_bit(bonds.data(), row_words,
+                     [&](size_t k)
+                     {
+                       const size_t root1 = this->find_root_const(first + k);
+                       const size_t root2 = this->find_root_const(first + k - strides[0]);
+
+                       // Neighbouring bonds usually join the same pair of clusters
+                       if (root1 != root2 && (pairs.empty() || pairs.back() != std::pair(root1, root2)))
+                       {
+                         pairs.emplace_back(root1, root2);
+                       }
+                     });
+  }
+
+  return pairs;
+}
+
+// Thread pool with num_threads threads, created on first use and kept for later simulations
+template <uint8_t dimension, uint8_t size_pow>
+thread_pool& hypercubic_bond_percolation<dimension, size_pow>::pool(uint8_t num_threads)
+{
+  if (!_pool || _pool->num_threads() != std::max<uint8_t>(num_threads, 1))
+  {
+    _pool = std::make_unique<thread_pool>(num_threads);
+  }
+  return *_pool;
+}
+
+// Count the central hypercube in chunks of planes along the first coordinate, one task each
+template <uint8_t dimension, uint8_t size_pow>
+cluster_histogram hypercubic_bond_percolation<dimension, size_pow>::count_clusters(size_t central_size, uint8_t num_threads)
+{
+  const int start_0 = (size - central_size) / 2;
+  const int end_0 = (size + central_size) / 2;
+
+  thread_pool& threads = pool(num_threads);
+  const size_t num_chunks = std::min<size_t>(end_0 - start_0, 4 * threads.num_threads());
+
+  std::vector<cluster_histogram> chunk_results(num_chunks);
+  task_group group;
+
+  for (size_t chunk = 0; chunk < num_chunks; ++chunk)
+  {
+    threads.submit(group,
+                   [&, chunk]()
+                   {
+                     chunk_results[chunk] = count_slab(start_0 + chunk * (end_0 - start_0) / num_chunks,
+                                                       start_0 + (chunk + 1) * (end_0 - start_0) / num_chunks, central_size);
+                   });
+  }
+  threads.wait(group);
+
+  cluster_histogram results;
+  for (const cluster_histogram& chunk_result : chunk_results)
+  {
+    merge_histograms(results, chunk_result);
+  }
+
+  return results;
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+cluster_histogram hypercubic_bond_percolation<dimension, size_pow>::count_slab(int start_0, int end_0, size_t central_size) const
+{
+  constexpr size_t rows_per_plane = num_rows / size;
+
+  scoped_phase profile(phase::count_clusters);
+  cluster_histogram results;
+
+  const int min_coordinate = (size - central_size) / 2;
+  const int max_coordinate = (size + central_size) / 2;
+  for (size_t row = start_0 * rows_per_plane; row < end_0 * rows_per_plane; ++row)
+  {
+    const size_t first = row << size_pow;
+    const site x = get_element(first);
+
+    // Rows outside the window in the middle coordinates are skipped, rather than stepped over, to keep the loop independent of dimension
+    bool in_window = true;
+    for (size_t d = 1; d + 1 < dimension; ++d)
+    {
+      in_window &= x[d] >= min_coordinate && x[d] < max_coordinate;
+    }
+    if (!in_window)
+    {
+      continue;
+    }
+
+    for (int k = min_coordinate; k < max_coordinate; ++k)
+    {
+      add_to_histogram(results, this->get_root(first + k).size, 1);
+    }
+  }
+
+  return results;
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::run_simulations(const std::string& folder_name, uint32_t num_simulations,
+                                                                      size_t central_size, uint8_t num_threads)
+{
+  std::println("Running {} simulations in {} dimensions with size {} for p={}", num_simulations, dimension, size, _probability);
+
+  if (central_size > size)
+  {
+    std::println("Central hypercube larger than simulation");
+    return;
+  }
+
+  const results_header header = make_results_header(model_name(), _probability, central_size, size, 0, dimension);
+  const std::filesystem::path path = results_path(folder_name, header);
+  const cluster_histogram results = run_checkpointed_simulations(path, header, num_simulations, _rng,
+                                                                 [&](uint32_t simulation_count)
+                                                                 {
+                                                                   phase_profiler::instance().set_simulation(simulation_count);
+                                                                   generate_clusters_parallel(num_threads);
+                                                                   return count_clusters(central_size, num_threads);
+                                                                 });
+
+  write_histogram_csv(folder_name, model_name(), _probability, central_size, size, num_simulations, results);
+
+  std::println("Completed {} simulations in {} dimensions with size {} for p={}", num_simulations, dimension, size, _probability);
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+wrapping_state hypercubic_bond_percolation<dimension, size_pow>::get_wrapping() const
+{
+  if (_boundary != boundary_condition::periodic)
+  {
+    throw std::logic_error("Clusters can only wrap with periodic boundaries, see set_boundary_condition");
+  }
+
+  constexpr uint8_t all_directions = (1u << dimension) - 1;
+  wrapping_state state = {0, false};
+  for (size_t index = 0; index < num_sites; ++index)
+  {
+    if (this->_forest[index].is_root(index))
+    {
+      state.directions |= (*_wrapping)[index];
+      state.single_cluster |= (*_wrapping)[index] == all_directions;
+    }
+  }
+
+  return state;
+}
+
+/*
+Writes the number of simulations in which some cluster wraps along any coordinate, along every coordinate (by a single cluster, or
+between them), and along each coordinate in turn.
+*/
+template <uint8_t dimension, uint8_t size_pow>
+void hypercubic_bond_percolation<dimension, size_pow>::run_wrapping_simulations(const std::string& folder_name, uint32_t num_simulations,
+                                                                               uint8_t num_threads)
+{
+  std::println("Running {} wrapping simulations in {} dimensions with size {} for p={}", num_simulations, dimension, size, _probability);
+  timer tm;
+
+  if (_boundary != boundary_condition::periodic)
+  {
+    throw std::logic_error("Clusters can only wrap with periodic boundaries, see set_boundary_condition");
+  }
+
+  constexpr uint32_t all_directions = (1u << dimension) - 1;
+  uint64_t num_any = 0;
+  uint64_t num_all = 0;
+  uint64_t num_single = 0;
+  std::array<uint64_t, dimension> num_direction = {};
+
+  for (uint32_t simulation_count = 0; simulation_count < num_simulations; ++simulation_count)
+  {
+    phase_profiler::instance().set_simulation(simulation_count);
+    tm.restart();
+
+    generate_clusters_parallel(num_threads);
+    const wrapping_state state = get_wrapping();
+
+    num_any += state.directions != 0;
+    num_all += state.directions == all_directions;
+    num_single += state.single_cluster;
+    for (size_t d = 0; d < dimension; ++d)
+    {
+      num_direction[d] += (state.directions >> d) & 1;
+    }
+
+    tm.stop();
+    std::println("Simulation number: {} wrapping along {:0{}b} finished in {} ms", simulation_count, state.directions, dimension, tm.get_ms());
+  }
+
+  const std::filesystem::path path = std::format("src/analyse_data/data/{}/{}_wrapping_p_{:.10f}_size_{}_num_{}.csv", folder_name, model_name(),
+                                                 _probability, size, num_simulations);
+  std::filesystem::create_directories(path.parent_path());
+  std::ofstream data_file(path);
+
+  data_file << "probability, dimension, simulation size, number of simulations\n";
+  data_file << std::format("{:.10f}, {}, {}, {}\n", _probability, dimension, size, num_simulations);
+  data_file << "\nwrapping,number of simulations\n";
+  data_file << std::format("any, {}\n", num_any);
+  data_file << std::format("all, {}\n", num_all);
+  data_file << std::format("single cluster all, {}\n", num_single);
+  for (size_t d = 0; d < dimension; ++d)
+  {
+    data_file << std::format("direction {}, {}\n", d, num_direction[d]);
+  }
+
+  std::println("Completed {} wrapping simulations in {} dimensions with size {} for p={}", num_simulations, dimension, size, _probability);
+}
+
+template class hypercubic_bond_percolation<2, 10>;
+template class hypercubic_bond_percolation<2, 12>;
+template class hypercubic_bond_percolation<3, 7>;
+template class hypercubic_bond_percolation<3, 8>;
+template class hypercubic_bond_percolation<4, 5>;
+template class hypercubic_bond_percolation<4, 6>;
+template class hypercubic_bond_percolation<5, 4>;
+template class hypercubic_bond_percolation<6, 3>;
+template class hypercubic_bond_percolation<6, 4>;
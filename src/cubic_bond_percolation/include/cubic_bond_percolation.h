@@ -2,20 +2,35 @@
 
 #define force_inline inline __attribute__((always_inline))
 
-#include <set>
+#include <memory>
+#include <optional>
 #include <stdint.h>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "gnuplot-iostream.h"
 
+#include "bond_sampler.h"
+#include "cluster_histogram.h"
+#include "cubic_layouts.h"
+#include "newman_ziff.h"
 #include "pcg_extras.hpp"
 #include "pcg_random.hpp"
 #include "percolation.h"
+#include "philox.h"
 #include "power.h"
+#include "thread_pool.h"
 
 // GNU plot has its limitations here. Do not waste too much time fiddling with it, will probably write something proper later anyway.
 
-class cubic_bond_percolation : public percolation<std::tuple<int, int, int>>
+/*
+node_type selects the layout of the forest, see disjoint_set_forest.hpp. compact_node_for picks the smallest one for a given
+number of sites, e.g. 4 bytes per site up to cube_pow = 10.
+layout_type selects the order of the sites in the forest, see cubic_layouts.h.
+*/
+template <typename node_type = packed_node, typename layout_type = row_major_layout>
+class cubic_bond_percolation : public basic_percolation<cubic_bond_percolation<node_type, layout_type>, std::tuple<int, int, int>, node_type>
 {
   /*
   Can possibly use a disjoint set union data structure.
@@ -24,16 +39,43 @@ class cubic_bond_percolation : public percolation<std::tuple<int, int, int>>
   Expected complexity: Hopefully in most cases we don't have to do much merging. Either way, should be amortized O(n*ackerman^-1(n)).
   */
 public:
-  cubic_bond_percolation(uint8_t cube_pow, double p);
+  using typename basic_percolation<cubic_bond_percolation<node_type, layout_type>, std::tuple<int, int, int>, node_type>::node;
+
+  // pages selects the pages backing the forest, see huge_page_vector.h
+  cubic_bond_percolation(uint8_t cube_pow, double p, page_policy pages = page_policy::normal);
+
+  // Bonds leading from a site to its previous neighbour along each coordinate
+  enum class bond_direction : uint64_t
+  {
+    k,
+    j,
+    i,
+  };
 
   void set_probability(double p);
+  void set_bond_sampling(bond_sampling mode);
 
-  size_t get_index(const std::tuple<int, int, int>& node) const override;
-  std::tuple<int, int, int> get_element(size_t index) const override;
-  bool on_boundary(const std::tuple<int, int, int>& node) const override;
+  /*
+  Pin the threads of parallel generation and counting to cores, see thread_pool.h. Each slab then goes to the same thread in every
+  simulation, and the forest pages of a slab are first touched (so placed on the NUMA node) by that thread. This only keeps memory
+  traffic local with a layout storing slabs contiguously, i.e. tiled_layout: with row_major_layout every page spans all slabs.
+  */
+  void set_thread_affinity(thread_affinity affinity);
+
+  // Draw bonds from counters instead of engines seeded from std::random_device, see cubic_bond_percolation.cpp
+  void set_seed(uint64_t campaign_seed, uint64_t simulation_id = 0);
+  bool bond_open(const std::tuple<int, int, int>& site, bond_direction direction) const;
+
+  size_t get_index(const std::tuple<int, int, int>& node) const;
+  std::tuple<int, int, int> get_element(size_t index) const;
+  bool on_boundary(const std::tuple<int, int, int>& node) const;
 
   void generate_clusters();
-  void generate_clusters_parallel(uint8_t max_num_threads);
+  void generate_clusters_parallel(uint8_t num_threads); // Any number of threads
+
+  // All threads merge anywhere in the cube at once with merge_concurrent, without a serial merge phase. Compact nodes only.
+  void generate_clusters_concurrent(uint8_t num_threads)
+    requires is_compact_node<node_type>;
 
   void plot_clusters(uint32_t min_cluster_size, size_t max_num_clusters = 10, const std::string& image_filename = "") const;
   void plot_central_clusters(uint32_t min_cluster_size, size_t central_cube_size = 64, size_t max_num_clusters = 10,
@@ -42,47 +84,108 @@ public:
   // Output the sizes of clusters for a single simulation
   void write_clusters_data(uint32_t min_cluster_size, size_t central_cube_size = 64) const;
 
-  // Run a number of simulations and collect cluster size data into bins
-  void run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size = 64, uint8_t max_num_threads = 4);
+  /*
+  Run a number of simulations and collect cluster size data into bins. Progress is checkpointed after every simulation, and a run
+  with the same parameters carries on from the last checkpoint, see checkpoint.h.
+  */
+  void run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size = 64, uint8_t num_threads = 4);
+
+  /*
+  Same output as run_simulations, for small cubes: rather than splitting each cube across threads, every thread runs whole
+  simulations on a replica with its own forest and engine, so they only meet to append each histogram to the results.
+  */
+  void run_replica_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size = 64, uint8_t num_threads = 4);
+
+  // Canonical results at every one of probabilities from Newman-Ziff sweeps over bonds with activation times in [min_p, max_p)
+  void run_newman_ziff(const std::string& folder_name, uint32_t num_sweeps, double min_p, double max_p, const std::vector<double>& probabilities,
+                       size_t central_cube_size = 64, uint8_t num_threads = 4);
 
 private:
-  void generate_merge_clusters_recursive(uint8_t max_num_threads, int start_i, int end_i);
-  void generate_clusters_parallel_thread(int start_i, int end_i);
-  void merge_clusters_slices(int i);
+  void generate_slab(int start_i, int end_i);
+  template <typename engine>
+  void generate_row(engine& rng, uint64_t* bonds, int i, int j, int start_i);
+  void merge_clusters_slices(int i, int level = 0); // level in the merge tree, for phase_profiler.h
+  template <typename engine>
+  void fill_bonds(engine& rng, uint64_t* bonds, int i, int j, bond_direction direction) const;
+  size_t row_stream(int i, int j) const;
+  size_t plane_owner(int i, size_t num_threads) const;
+  template <typename engine>
+  void merge_row_concurrent(engine& rng, uint64_t* bonds, int i, int j)
+    requires is_compact_node<node_type>;
+
+  std::vector<bool> get_central_roots(size_t central_cube_size) const;
 
-  std::vector<std::pair<uint64_t, uint64_t>> count_clusters_parallel_recursive(uint8_t max_num_threads, int start_i, int end_i,
-                                                                               size_t central_cube_size) const;
-  std::vector<std::pair<uint64_t, uint64_t>> count_clusters_parallel_thread(int start_i, int end_i, size_t central_cube_size) const;
+  cluster_histogram count_clusters_parallel(uint8_t num_threads, int start_i, int end_i, size_t central_cube_size);
+  cluster_histogram count_clusters_parallel_thread(int start_i, int end_i, size_t central_cube_size) const;
+
+  std::pair<uint64_t, std::vector<newman_ziff_bond>> collect_window_bonds(uint64_t min_bound, uint64_t max_bound, uint8_t num_threads);
+
+  thread_pool& pool(uint8_t num_threads);
+  Gnuplot& plot() const;
 
   const uint8_t _cube_pow;
   const uint32_t _cube_size;
+  const layout_type _layout;
+
+  const size_t _row_words; // Words in the bond mask of a row of sites along z
 
   double _probability;
-  uint64_t _bound;
+  bond_sampler _sampler;
 
   pcg64_fast _rng;
+  std::optional<philox4x64::key> _counter_key; // (campaign seed, simulation id) in counter-based mode
+
+  std::unique_ptr<thread_pool> _pool;
+  thread_affinity _affinity = thread_affinity::none;
 
-  mutable Gnuplot _gp;
+  mutable std::unique_ptr<Gnuplot> _gp;
 };
 
-// Need to speed this up... Maybe write in assembly by hand
-force_inline size_t cubic_bond_percolation::get_index(const std::tuple<int, int, int>& node) const
+template <typename node_type, typename layout_type>
+force_inline size_t cubic_bond_percolation<node_type, layout_type>::get_index(const std::tuple<int, int, int>& node) const
 {
-  return static_cast<size_t>(std::get<0>(node)) | (static_cast<size_t>(std::get<1>(node) << _cube_pow)) |
-         (static_cast<size_t>(std::get<2>(node)) << (2 * _cube_pow));
+  return _layout.get_index(std::get<0>(node), std::get<1>(node), std::get<2>(node));
 }
 
-force_inline std::tuple<int, int, int> cubic_bond_percolation::get_element(size_t index) const
+template <typename node_type, typename layout_type>
+force_inline std::tuple<int, int, int> cubic_bond_percolation<node_type, layout_type>::get_element(size_t index) const
 {
-  std::tuple<int, int, int> element;
-  std::get<2>(element) = index >> (2 * _cube_pow);
-  std::get<1>(element) = (index >> _cube_pow) - (std::get<2>(element) << _cube_pow);
-  std::get<0>(element) = index - (std::get<1>(element) << _cube_pow) - (std::get<2>(element) << (2 * _cube_pow));
-  return element;
+  return _layout.get_element(index);
 }
 
-force_inline bool cubic_bond_percolation::on_boundary(const std::tuple<int, int, int>& node) const
+template <typename node_type, typename layout_type>
+force_inline bool cubic_bond_percolation<node_type, layout_type>::on_boundary(const std::tuple<int, int, int>& node) const
 {
   return std::get<0>(node) == 0 || std::get<0>(node) == _cube_size - 1 || std::get<1>(node) == 0 || std::get<1>(node) == _cube_size - 1 ||
          std::get<2>(node) == 0 || std::get<2>(node) == _cube_size - 1;
 }
+
+// Bonds of row (i, j, *) in the given direction, from the engine or from the row's counter-based stream
+template <typename node_type, typename layout_type>
+template <typename engine>
+force_inline void cubic_bond_percolation<node_type, layout_type>::fill_bonds(engine& rng, uint64_t* bonds, int i, int j,
+                                                                           bond_direction direction) const
+{
+  if (_counter_key)
+  {
+    philox_stream stream(*_counter_key, row_stream(i, j), static_cast<uint64_t>(direction));
+    _sampler.fill(stream, bonds, _cube_size);
+  }
+  else
+  {
+    _sampler.fill(rng, bonds, _cube_size);
+  }
+}
+
+template <typename node_type, typename layout_type>
+force_inline size_t cubic_bond_percolation<node_type, layout_type>::row_stream(int i, int j) const
+{
+  return (static_cast<size_t>(i) << _cube_pow) | static_cast<size_t>(j);
+}
+
+// Thread which generates and counts plane i, so that the same thread touches the same part of the forest throughout
+template <typename node_type, typename layout_type>
+force_inline size_t cubic_bond_percolation<node_type, layout_type>::plane_owner(int i, size_t num_threads) const
+{
+  return static_cast<size_t>(i) * num_threads / _cube_size;
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <algorithm>
+#include <stdint.h>
+#include <tuple>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+/*
+Site orderings for cubic_bond_percolation. Each layout maps (x, y, z) in [0, 2^cube_pow)^3 to a unique index in [0, 2^(3 cube_pow))
+and back:
+
+  size_t get_index(int x, int y, int z) const;
+  std::tuple<int, int, int> get_element(size_t index) const;
+
+The ordering decides how far apart neighbouring sites (and so the nodes touched by merge and find) are in memory.
+*/
+
+// Original ordering: x | y << pow | z << 2pow. Neighbours in the z direction, which is the innermost loop, are 2^(2pow) apart.
+class row_major_layout
+{
+public:
+  row_major_layout(uint8_t cube_pow) : _cube_pow(cube_pow)
+  {
+  }
+
+  force_inline size_t get_index(int x, int y, int z) const
+  {
+    return static_cast<size_t>(x) | (static_cast<size_t>(y) << _cube_pow) | (static_cast<size_t>(z) << (2 * _cube_pow));
+  }
+
+  force_inline std::tuple<int, int, int> get_element(size_t index) const
+  {
+    const size_t mask = (size_t(1) << _cube_pow) - 1;
+    return {index & mask, (index >> _cube_pow) & mask, index >> (2 * _cube_pow)};
+  }
+
+private:
+  const uint8_t _cube_pow;
+};
+
+/*
+Z-order curve, interleaving the bits of the coordinates as ...x1y1z1x0y0z0. Every aligned 2^k cube is contiguous, so sites close
+in any direction are usually close in memory. Supports cube_pow <= 21.
+*/
+class morton_layout
+{
+public:
+  morton_layout(uint8_t)
+  {
+  }
+
+  force_inline size_t get_index(int x, int y, int z) const
+  {
+#ifdef __BMI2__
+    return _pdep_u64(z, _mask) | _pdep_u64(y, _mask << 1) | _pdep_u64(x, _mask << 2);
+#else
+    return spread_bits(z) | (spread_bits(y) << 1) | (spread_bits(x) << 2);
+#endif
+  }
+
+  force_inline std::tuple<int, int, int> get_element(size_t index) const
+  {
+#ifdef __BMI2__
+    return {_pext_u64(index, _mask << 2), _pext_u64(index, _mask << 1), _pext_u64(index, _mask)};
+#else
+    return {compact_bits(index >> 2), compact_bits(index >> 1), compact_bits(index)};
+#endif
+  }
+
+private:
+  static constexpr uint64_t _mask = 0x1249249249249249; // Every third bit
+
+  // Move bit i of the (21 bit) value to bit 3i
+  static force_inline uint64_t spread_bits(uint64_t value)
+  {
+    value &= 0x1fffff;
+    value = (value | value << 32) & 0x1f00000000ffff;
+    value = (value | value << 16) & 0x1f0000ff0000ff;
+    value = (value | value << 8) & 0x100f00f00f00f00f;
+    value = (value | value << 4) & 0x10c30c30c30c30c3;
+    value = (value | value << 2) & 0x1249249249249249;
+    return value;
+  }
+
+  // Inverse of spread_bits
+  static force_inline uint64_t compact_bits(uint64_t value)
+  {
+    value &= 0x1249249249249249;
+    value = (value ^ (value >> 2)) & 0x10c30c30c30c30c3;
+    value = (value ^ (value >> 4)) & 0x100f00f00f00f00f;
+    value = (value ^ (value >> 8)) & 0x1f0000ff0000ff;
+    value = (value ^ (value >> 16)) & 0x1f00000000ffff;
+    value = (value ^ (value >> 32)) & 0x1fffff;
+    return value;
+  }
+};
+
+/*
+Cubic tiles of 2^tile_pow sites a side stored contiguously (z fastest within a tile), with the tiles themselves ordered z fastest
+and x slowest. A 16^3 tile of 4 byte nodes is 16 KiB, so the three previous neighbours of a site are nearly always in L1/L2, and
+every slab of whole tiles in x is a contiguous range of the forest.
+*/
+template <uint8_t tile_pow = 4>
+class tiled_layout
+{
+public:
+  tiled_layout(uint8_t cube_pow) : _tile_pow(std::min(tile_pow, cube_pow)), _grid_pow(cube_pow - _tile_pow)
+  {
+  }
+
+  force_inline size_t get_index(int x, int y, int z) const
+  {
+    const size_t tile_mask = (size_t(1) << _tile_pow) - 1;
+    const size_t tile = static_cast<size_t>(z >> _tile_pow) | (static_cast<size_t>(y >> _tile_pow) << _grid_pow) |
+                        (static_cast<size_t>(x >> _tile_pow) << (2 * _grid_pow));
+    const size_t offset = (z & tile_mask) | ((y & tile_mask) << _tile_pow) | ((x & tile_mask) << (2 * _tile_pow));
+    return (tile << (3 * _tile_pow)) | offset;
+  }
+
+  force_inline std::tuple<int, int, int> get_element(size_t index) const
+  {
+    const size_t tile_mask = (size_t(1) << _tile_pow) - 1;
+    const size_t grid_mask = (size_t(1) << _grid_pow) - 1;
+    const size_t tile = index >> (3 * _tile_pow);
+    return {((tile >> (2 * _grid_pow)) << _tile_pow) | ((index >> (2 * _tile_pow)) & tile_mask),
+            (((tile >> _grid_pow) & grid_mask) << _tile_pow) | ((index >> _tile_pow) & tile_mask),
+            ((tile & grid_mask) << _tile_pow) | (index & tile_mask)};
+  }
+
+private:
+  const uint8_t _tile_pow;
+  const uint8_t _grid_pow;
+};
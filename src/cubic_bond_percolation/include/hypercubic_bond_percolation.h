@@ -0,0 +1,345 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <array>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bond_sampler.h"
+#include "cluster_histogram.h"
+#include "huge_page_vector.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "percolation.h"
+#include "thread_pool.h"
+
+enum class boundary_condition
+{
+  free,     // Clusters touching a face count as still growing
+  periodic, // Bonds wrap across opposite faces, making the lattice a torus
+};
+
+// Which coordinates clusters wrap along in a periodic simulation
+struct wrapping_state
+{
+  uint32_t directions; // Bit d set if some cluster wraps along coordinate d
+  bool single_cluster; // Whether a single cluster wraps along every coordinate
+};
+
+/*
+Bond percolation on the hypercube of side 2^size_pow in any dimension, e.g. the upper critical dimension 6, with everything that
+depends on the dimension fixed at compile time: strides, the loop over bond directions and the boundary tests.
+
+Sites are stored in row major order with the last coordinate varying fastest, so site x has index sum_d x[d] * strides[d]. The sites
+along the last coordinate form a row, whose bonds in each direction are drawn as one bit mask as in cubic_bond_percolation, and
+a slab of consecutive values of the first coordinate is a contiguous range of the forest.
+
+With periodic boundaries, every node also stores its displacement from its parent in the forest, in the unwrapped coordinates of
+its cluster, which find_root_displaced sums up to the displacement from the root. A bond joining two sites already in the same
+cluster then closes a loop whose displacement is a non-zero multiple of the size along each coordinate the loop winds around, and
+the root collects these coordinates as its wrapping mask. A cluster wraps along a coordinate exactly if it contains such a loop,
+so wrapping is detected without any extra pass over the lattice.
+
+The dimensions and sizes available are instantiated in hypercubic_bond_percolation.cpp.
+*/
+template <uint8_t dimension, uint8_t size_pow>
+class hypercubic_bond_percolation : public basic_percolation<hypercubic_bond_percolation<dimension, size_pow>, std::array<int, dimension>,
+                                                             compact_node_for<uint64_t(1) << (dimension * size_pow)>>
+{
+  static_assert(dimension >= 2, "Use a lattice of its own for one dimension");
+  static_assert(dimension * size_pow < 64, "Sites must be indexable by 64 bits");
+  static_assert(dimension <= 8, "Wrapping masks are a byte per site");
+
+public:
+  using site = std::array<int, dimension>;
+  using displacement = std::array<int32_t, dimension>;
+
+  static constexpr int size = 1 << size_pow;
+  static constexpr size_t num_sites = size_t(1) << (dimension * size_pow);
+  static constexpr size_t num_rows = num_sites >> size_pow;
+  static constexpr size_t row_words = (size + 63) / 64; // Words in the bond mask of a row
+
+  // Distance in the forest between neighbours along each coordinate
+  static constexpr std::array<size_t, dimension> strides = []()
+  {
+    std::array<size_t, dimension> result;
+    for (size_t d = 0; d < dimension; ++d)
+    {
+      result[d] = size_t(1) << (size_pow * (dimension - 1 - d));
+    }
+    return result;
+  }();
+
+  // pages selects the pages backing the forest, see huge_page_vector.h
+  hypercubic_bond_percolation(double p, page_policy pages = page_policy::normal);
+
+  void set_probability(double p);
+  void set_bond_sampling(bond_sampling mode);
+  void set_boundary_condition(boundary_condition boundary);
+
+  size_t get_index(const site& node) const;
+  site get_element(size_t index) const;
+  bool on_boundary(const site& node) const;
+
+  void generate_clusters();
+  void generate_clusters_parallel(uint8_t num_threads); // Any number of threads
+
+  // Histogram of the sites of the central hypercube of side central_size
+  cluster_histogram count_clusters(size_t central_size, uint8_t num_threads = 4);
+
+  // As cubic_bond_percolation::run_simulations, checkpointed in the same way
+  void run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_size = 16, uint8_t num_threads = 4);
+
+  // Wrapping of the clusters of the last simulation, periodic boundaries only
+  wrapping_state get_wrapping() const;
+
+  /*
+  Count the simulations in which clusters wrap, for estimates of the wrapping probabilities, whose crossings of their values at the
+  threshold converge far faster with size than the central cube histogram. Periodic boundaries only.
+  */
+  void run_wrapping_simulations(const std::string& folder_name, uint32_t num_simulations, uint8_t num_threads = 4);
+
+  // e.g. hypercubic_6d_bond_percolation or hypercubic_6d_periodic_bond_percolation, naming the results files
+  std::string model_name() const;
+
+private:
+  template <bool periodic, typename engine>
+  void generate_slab(engine& rng, int start_0, int end_0);
+  template <bool periodic, typename engine>
+  void generate_row(engine& rng, uint64_t* bonds, size_t row, int start_0);
+  template <bool periodic, size_t direction, typename engine>
+  void merge_direction(engine& rng, uint64_t* bonds, size_t first, const site& x, int start_0);
+  template <bool periodic, size_t direction>
+  void merge_bond(size_t index1, size_t index2);
+
+  // Periodic boundaries only
+  template <typename engine>
+  void merge_plane_periodic(engine& rng, int plane);
+  size_t find_root_displaced(size_t index, displacement& offset);
+  template <size_t direction>
+  void merge_periodic(size_t index1, size_t index2);
+
+  std::vector<std::pair<size_t, size_t>> find_slab_root_pairs(int plane, size_t first_row, size_t end_row) const;
+  cluster_histogram count_slab(int start_0, int end_0, size_t central_size) const;
+
+  thread_pool& pool(uint8_t num_threads);
+
+  double _probability;
+  bond_sampler _sampler;
+
+  pcg64_fast _rng;
+
+  boundary_condition _boundary = boundary_condition::free;
+  std::unique_ptr<huge_page_vector<displacement>> _displacements; // From each node to its parent, allocated for periodic boundaries
+  std::unique_ptr<huge_page_vector<uint8_t>> _wrapping;           // Coordinates each root wraps along, as a bit mask
+
+  std::unique_ptr<thread_pool> _pool;
+};
+
+template <uint8_t dimension, uint8_t size_pow>
+force_inline size_t hypercubic_bond_percolation<dimension, size_pow>::get_index(const site& node) const
+{
+  size_t index = 0;
+  for (size_t d = 0; d < dimension; ++d)
+  {
+    index += static_cast<size_t>(node[d]) * strides[d];
+  }
+  return index;
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+force_inline typename hypercubic_bond_percolation<dimension, size_pow>::site hypercubic_bond_percolation<dimension, size_pow>::get_element(
+    size_t index) const
+{
+  site node;
+  for (size_t d = 0; d < dimension; ++d)
+  {
+    node[d] = static_cast<int>((index >> (size_pow * (dimension - 1 - d))) & (size - 1));
+  }
+  return node;
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+force_inline bool hypercubic_bond_percolation<dimension, size_pow>::on_boundary(const site& node) const
+{
+  if (_boundary == boundary_condition::periodic)
+  {
+    return false;
+  }
+
+  bool result = false;
+  for (size_t d = 0; d < dimension; ++d)
+  {
+    result |= node[d] == 0 || node[d] == size - 1;
+  }
+  return result;
+}
+
+/*
+Make sets for the row starting at index first, then merge each site with its previous neighbour in every direction if the bond
+between them is open, one direction after the other in a loop unrolled at compile time. Bonds along the first coordinate are only
+followed inside the slab: those between slabs are drawn by generate_clusters_parallel once all slabs are done.
+With periodic boundaries the bonds wrapping around the other coordinates are drawn by the rows on the last face, whose neighbours
+across the wrap on the first face are already made.
+*/
+template <uint8_t dimension, uint8_t size_pow>
+template <bool periodic, typename engine>
+force_inline void hypercubic_bond_percolation<dimension, size_pow>::generate_row(engine& rng, uint64_t* bonds, size_t row, int start_0)
+{
+  const size_t first = row << size_pow;
+  const site x = get_element(first);
+
+  bool row_on_boundary = false;
+  for (size_t d = 0; d + 1 < dimension; ++d)
+  {
+    row_on_boundary |= x[d] == 0 || x[d] == size - 1;
+  }
+  for (int k = 0; k < size; ++k)
+  {
+    this->_forest[first + k].make_root(first + k, !periodic && (row_on_boundary || k == 0 || k == size - 1) ? -1 : 1);
+    if constexpr (periodic)
+    {
+      (*_displacements)[first + k] = {};
+      (*_wrapping)[first + k] = 0;
+    }
+  }
+
+  [&]<size_t... direction>(std::index_sequence<direction...>)
+  {
+    (merge_direction<periodic, direction>(rng, bonds, first, x, start_0), ...);
+  }(std::make_index_sequence<dimension>{});
+}
+
+template <uint8_t dimension, uint8_t size_pow>
+template <bool periodic, size_t direction, typename engine>
+force_inline void hypercubic_bond_percolation<dimension, size_pow>::merge_direction(engine& rng, uint64_t* bonds, size_t first, const site& x,
+                                                                                    int start_0)
+{
+  if constexpr (direction == dimension - 1)
+  {
+    _sampler.fill(rng, bonds, size);
+    if (periodic && (bonds[0] & 1))
+    {
+      merge_bond<periodic, direction>(first + size - 1, first); // Around the row
+    }
+    bonds[0] &= ~uint64_t(1); // No bond before the first site of the row
+    for_each_set_bit(bonds, row_words, [&](size_t k) { merge_bond<periodic, direction>(first + k - 1, first + k); });
+  }
+  else
+  {
+    if (x[direction] != (direction == 0 ? start_0 : 0))
+    {
+      _sampler.fill(rng, bonds, size);
+      for_each_set_bit(bonds, row_words, [&](size_t k) { merge_bond<periodic, direction>(first + k - strides[direction], first + k); });
+    }
+    if (periodic && direction != 0 && x[direction] == size - 1)
+    {
+      _sampler.fill(rng, bonds, size);
+      for_each_set_bit(bonds, row_words,
+                       [&](size_t k) { merge_bond<periodic, direction>(first + k, first + k - (size - 1) * strides[direction]); });
+    }
+  }
+}
+
+// Merge along the bond from index1 to index2, its neighbour one step further along direction (possibly across the wrap)
+template <uint8_t dimension, uint8_t size_pow>
+template <bool periodic, size_t direction>
+force_inline void hypercubic_bond_percolation<dimension, size_pow>::merge_bond(size_t index1, size_t index2)
+{
+  if constexpr (periodic)
+  {
+    merge_periodic<direction>(index1, index2);
+  }
+  else
+  {
+    this->merge_indices(index1, index2);
+  }
+}
+
+// Root of index, with offset set to the displacement from the root to index, halving the path as find_root does
+template <uint8_t dimension, uint8_t size_pow>
+force_inline size_t hypercubic_bond_percolation<dimension, size_pow>::find_root_displaced(size_t index, displacement& offset)
+{
+  huge_page_vector<displacement>& displacements = *_displacements;
+  offset = {};
+
+  while (!this->_forest[index].is_root(index))
+  {
+    const size_t parent = this->_forest[index].parent(index);
+    if (this->_forest[parent].is_root(parent))
+    {
+      for (size_t d = 0; d < dimension; ++d)
+      {
+        offset[d] += displacements[index][d];
+      }
+      return parent;
+    }
+
+    const size_t grandparent = this->_forest[parent].parent(parent);
+    for (size_t d = 0; d < dimension; ++d)
+    {
+      displacements[index][d] += displacements[parent][d];
+      offset[d] += displacements[index][d];
+    }
+    this->_forest[index].set_parent(grandparent);
+    index = grandparent;
+  }
+  return index;
+}
+
+/*
+Merge by size as merge_indices does, keeping displacements consistent: the root linked gets its displacement from the other root.
+If both sites are already in the same cluster, the bond closes a loop whose displacement is non-zero along every coordinate the
+loop wraps around.
+*/
+template <uint8_t dimension, uint8_t size_pow>
+template <size_t direction>
+force_inline void hypercubic_bond_percolation<dimension, size_pow>::merge_periodic(size_t index1, size_t index2)
+{
+  displacement offset1;
+  displacement offset2;
+  const size_t root1 = find_root_displaced(index1, offset1);
+  const size_t root2 = find_root_displaced(index2, offset2);
+
+  // Position of root2 less that of root1, with the site of index2 one step along direction from that of index1
+  displacement between;
+  for (size_t d = 0; d < dimension; ++d)
+  {
+    between[d] = offset1[d] - offset2[d] + (d == direction);
+  }
+
+  if (root1 == root2)
+  {
+    for (size_t d = 0; d < dimension; ++d)
+    {
+      (*_wrapping)[root1] |= (between[d] != 0) << d;
+    }
+    return;
+  }
+
+  const int64_t size = this->_forest[root1].cluster_size() + this->_forest[root2].cluster_size();
+  const uint8_t wrapping = (*_wrapping)[root1] | (*_wrapping)[root2];
+
+  if (this->_forest[root1].cluster_size() < this->_forest[root2].cluster_size())
+  {
+    for (size_t d = 0; d < dimension; ++d)
+    {
+      between[d] = -between[d];
+    }
+    this->_forest[root1].set_parent(root2);
+    (*_displacements)[root1] = between;
+    this->_forest[root2].make_root(root2, size);
+    (*_wrapping)[root2] = wrapping;
+  }
+  else
+  {
+    this->_forest[root2].set_parent(root1);
+    (*_displacements)[root2] = between;
+    this->_forest[root1].make_root(root1, size);
+    (*_wrapping)[root1] = wrapping;
+  }
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bond_sampler.h"
+#include "cluster_histogram.h"
+#include "disjoint_set_forest.hpp"
+#include "memory_mapped_vector.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "percolation.h"
+
+/*
+Full-lattice cubic bond percolation with the forest kept in a file instead of in memory, for cubes whose forest is larger than RAM
+(cube_pow = 11 is 64 GiB of 8 byte nodes).
+
+The cube is split into slabs of whole planes of constant i, sized so that num_threads slab forests fit in memory_budget bytes. Each
+worker builds the forest of a slab in RAM, moves the root of every cluster touching either face of the slab onto that face, fully
+compresses the forest and copies it into the slab's contiguous region of the file, which is then written back and dropped from
+memory. Only clusters reaching a face can still grow, so once every slab is written the bonds between slabs are merged on the file
+directly: the two faces involved and the earlier faces holding their roots are the only pages touched, in order along each face.
+
+Sites are stored with i slowest: site (i, j, k) has index i << 2pow | j << pow | k, so a slab is one contiguous range.
+*/
+class out_of_core_cubic_bond_percolation
+{
+public:
+  using node = compact_node<uint64_t>;
+
+  // The file backing the forest is created in directory, which needs room for 8 * 2^(3 cube_pow) bytes
+  out_of_core_cubic_bond_percolation(uint8_t cube_pow, double p, size_t memory_budget, const std::string& directory = "/tmp/");
+
+  void set_probability(double p);
+  void set_bond_sampling(bond_sampling mode);
+
+  // Generate a configuration of the whole cube, returning the histogram of the central cube
+  cluster_histogram generate_clusters(uint8_t num_threads, size_t central_cube_size);
+
+  // Root and signed size of the cluster containing site (i, j, k), for the last configuration generated
+  cluster_root get_root(int i, int j, int k) const;
+
+  // Same output as cubic_bond_percolation::run_simulations, under a model name of its own so that the results and checkpoints of the
+  // two are kept apart
+  void run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size = 64, uint8_t num_threads = 8);
+
+private:
+  force_inline size_t get_index(int i, int j, int k) const
+  {
+    return (static_cast<size_t>(i) << (2 * _cube_pow)) | (static_cast<size_t>(j) << _cube_pow) | static_cast<size_t>(k);
+  }
+
+  size_t slab_planes(uint8_t num_threads) const;
+
+  void generate_slab(pcg64_fast& rng, std::vector<node>& slab, size_t start_i, size_t end_i, size_t central_cube_size, cluster_histogram& results);
+  void merge_slabs(size_t i);
+
+  const uint8_t _cube_pow;
+  const uint32_t _cube_size;
+  const size_t _plane_size;
+  const size_t _row_words; // Words in the bond mask of a row of sites along k
+  const size_t _memory_budget;
+
+  double _probability;
+  bond_sampler _sampler;
+
+  pcg64_fast _rng;
+
+  memory_mapped_vector<node> _forest;
+
+  // Central sites of clusters whose root is on a slab face, by root, as those clusters may still be merged across slabs
+  std::unordered_map<size_t, uint64_t> _face_central_sites;
+  std::mutex _mutex;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <cmath>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bond_sampler.h"
+#include "cluster_histogram.h"
+#include "disjoint_set_forest.hpp"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+
+// Axis of the cube along which a spanning cluster joins the two opposite faces, i being the direction of the sweep
+enum class spanning_axis : uint8_t
+{
+  i,
+  j,
+  k,
+};
+
+/*
+Fraction of runs with a spanning cluster, and what the runs cost: each stops as soon as its outcome is known, so planes_swept out
+of num_runs * cube size is the fraction of the full sweeps actually done.
+*/
+struct spanning_estimate
+{
+  uint32_t num_runs = 0;
+  uint32_t num_spanning = 0;
+  uint64_t planes_swept = 0;
+  double sum_ms = 0;
+  double sum_squared_ms = 0;
+
+  double probability() const
+  {
+    return static_cast<double>(num_spanning) / num_runs;
+  }
+
+  // Binomial standard error of probability
+  double standard_error() const
+  {
+    return std::sqrt(probability() * (1 - probability()) / num_runs);
+  }
+
+  double mean_planes() const
+  {
+    return static_cast<double>(planes_swept) / num_runs;
+  }
+
+  double mean_ms() const
+  {
+    return sum_ms / num_runs;
+  }
+
+  double stddev_ms() const
+  {
+    return num_runs < 2 ? 0 : std::sqrt(std::max(0.0, (sum_squared_ms - sum_ms * mean_ms()) / (num_runs - 1)));
+  }
+};
+
+/*
+Streaming (Hoshen-Kopelman style) version of cubic_bond_percolation::run_simulations, for cubes whose forest does not fit in memory.
+The cube is swept one plane of constant i at a time, keeping labels only for the previous and the current plane, with a union-find
+over those labels. Once a plane is done, every cluster of the previous plane with no site in the current plane can no longer grow,
+so it is emitted to the histogram straight away.
+
+Memory is 34 L^2 bytes instead of 4-12 L^3: 544 MiB at L = 4096, 2.1 GiB at L = 8192 and 8.5 GiB at L = 16384.
+Sites are visited and bonds drawn in the same order as cubic_bond_percolation::generate_clusters, so given the same engine state
+both produce the same histogram.
+
+Every root also carries the mask of the faces of the cube its cluster touches, so the sweep can stop early when only spanning
+matters: across the sweep (axis j or k) as soon as a cluster joins both faces, which above the threshold happens within a few planes,
+and along it (axis i) as soon as no cluster from the first plane reaches the current one, which below the threshold happens just as
+soon. Near the threshold the sweep rarely gets far in one of the two cases.
+*/
+class streaming_cubic_bond_percolation
+{
+public:
+  streaming_cubic_bond_percolation(uint8_t cube_pow, double p);
+
+  void set_probability(double p);
+  void set_bond_sampling(bond_sampling mode);
+
+  // Sweep a single configuration, returning the histogram of the central cube
+  cluster_histogram simulate(size_t central_cube_size);
+
+  // Same output as cubic_bond_percolation::run_simulations, under a model name of its own so that the results and checkpoints of the
+  // two are kept apart
+  void run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size = 64);
+
+  // Sweep a single configuration until it is known whether a cluster spans the cube along axis, returning that and the planes swept
+  std::pair<bool, uint32_t> simulate_spanning(spanning_axis axis);
+
+  // Spanning probability from num_simulations configurations, also written out as CSV
+  spanning_estimate run_spanning_simulations(const std::string& folder_name, uint32_t num_simulations, spanning_axis axis = spanning_axis::k);
+
+private:
+  // Labels use the single word layout of the forest: a parent label, or the size and boundary flag of the cluster at a root
+  using label = compact_node<uint64_t>;
+
+  // Face mask bit of the first or last face across axis
+  static constexpr uint8_t face(spanning_axis axis, bool last)
+  {
+    return uint8_t(1) << (2 * static_cast<int>(axis) + last);
+  }
+
+  size_t find_root(size_t index);
+  void merge(size_t index1, size_t index2);
+
+  void sweep_plane(uint32_t i, uint32_t min_coordinate, uint32_t max_coordinate, uint64_t* bonds);
+  void relocate_roots(size_t current_plane, size_t previous_plane);
+  void emit_roots(size_t plane, cluster_histogram& results) const;
+  std::pair<bool, uint8_t> scan_faces(size_t plane, uint8_t spanning_faces) const;
+
+  const uint8_t _cube_pow;
+  const uint32_t _cube_size;
+  const size_t _plane_size;
+  const size_t _row_words; // Words in the bond mask of a row of sites along k
+
+  double _probability;
+  bond_sampler _sampler;
+
+  pcg64_fast _rng;
+
+  // Two planes of labels, at offsets 0 and _plane_size, alternating between previous and current. Site (i, j, k) has label
+  // (i % 2) * _plane_size + (j << cube_pow) + k.
+  std::vector<label> _labels;
+  std::vector<uint64_t> _central_sites; // Number of sites of the central cube in the cluster, valid at roots
+  std::vector<uint8_t> _faces;          // Faces of the cube the cluster touches, valid at roots
+};
+
+// Find root with path halving
+force_inline size_t streaming_cubic_bond_percolation::find_root(size_t index)
+{
+  while (!_labels[index].is_root(index))
+  {
+    const size_t parent = _labels[index].parent(index);
+    if (_labels[parent].is_root(parent))
+    {
+      return parent;
+    }
+
+    const size_t grandparent = _labels[parent].parent(parent);
+    _labels[index].set_parent(grandparent);
+    index = grandparent;
+  }
+  return index;
+}
+
+force_inline void streaming_cubic_bond_percolation::merge(size_t index1, size_t index2)
+{
+  const size_t root1 = find_root(index1);
+  const size_t root2 = find_root(index2);
+
+  if (root1 == root2)
+  {
+    return;
+  }
+
+  const int64_t size1 = _labels[root1].cluster_size();
+  const int64_t size2 = _labels[root2].cluster_size();
+  const int64_t size = (std::abs(size1) + std::abs(size2)) * (1 - 2 * (size1 < 0 || size2 < 0));
+  const uint64_t central_sites = _central_sites[root1] + _central_sites[root2];
+  const uint8_t faces = _faces[root1] | _faces[root2];
+
+  if (std::abs(size1) < std::abs(size2))
+  {
+    _labels[root1].set_parent(root2);
+    _labels[root2].make_root(root2, size);
+    _central_sites[root2] = central_sites;
+    _faces[root2] = faces;
+  }
+  else
+  {
+    _labels[root2].set_parent(root1);
+    _labels[root1].make_root(root1, size);
+    _central_sites[root1] = central_sites;
+    _faces[root1] = faces;
+  }
+}
@@ -0,0 +1,65 @@
+#include <print>
+#include <stdint.h>
+#include <tuple>
+
+#include "cubic_bond_percolation.h"
+#include "hypercubic_bond_percolation.h"
+#include "out_of_core_cubic_bond_percolation.h"
+#include "streaming_cubic_bond_percolation.h"
+#include "power.h"
+
+int main()
+{
+  // 2^30 sites fit in the 4 byte node layout. Huge pages cut the TLB misses of find, falling back to smaller pages if unavailable.
+  cubic_bond_percolation<compact_node_for<ipow_tmp<2, 30>::value>> perc(10, 0.2488, page_policy::huge_1g);
+  std::println("Forest in {}", perc.forest_pages());
+
+  // Reproducible runs, identical whatever the number of threads: perc.set_seed(2024);
+
+  // TODO: plots show size as being one too large.
+
+  for (auto [probability, count] = std::tuple<double, size_t>{0.24878, 0}; count < 8; ++count, probability += 0.00001)
+  {
+    std::println("Loop {}: Generating clusters for probability={:.10f}", count, probability);
+    perc.set_probability(probability);
+    perc.run_simulations("test4", 100, 128, 8);
+
+    // perc.generate_clusters_parallel(4);
+    // perc.write_clusters_data(1, 64);
+  }
+
+  // Small cubes for finite size scaling run whole simulations per thread instead
+  /* cubic_bond_percolation<compact_node_for<ipow_tmp<2, 21>::value>> small_perc(7, 0.2488);
+  small_perc.run_replica_simulations("test4", 10000, 64, 8); */
+
+  // The same probabilities from a single Newman-Ziff sweep per simulation, over the window [0.24870, 0.24890)
+  /* perc.run_newman_ziff("test4", 100, 0.24870, 0.24890, {0.24878, 0.24880, 0.24882, 0.24884}, 128, 8); */
+
+  // Cubes too large for the forest can be swept a plane at a time instead, in O(L^2) memory
+  /* streaming_cubic_bond_percolation streaming_perc(12, 0.2488);
+  streaming_perc.run_simulations("test4", 10, 128); */
+
+  // Only whether a cluster spans the cube, stopping each sweep as soon as that is known
+  /* streaming_perc.run_spanning_simulations("test4", 1000, spanning_axis::k); */
+
+  // Full forest in a file, for cubes whose forest does not fit in memory: 64 GiB on disk, 8 GiB of slabs in memory
+  /* out_of_core_cubic_bond_percolation out_of_core_perc(11, 0.2488, size_t(8) << 30, "/tmp/");
+  out_of_core_perc.run_simulations("test4", 10, 128, 8); */
+
+  // Other dimensions, here 6 (the upper critical dimension) with side 16, near its bond threshold
+  /* hypercubic_bond_percolation<6, 4> hypercubic_perc(0.0942);
+  hypercubic_perc.run_simulations("test4", 100, 8, 8); */
+
+  // Wrapping probabilities with periodic boundaries, which locate the threshold with far smaller lattices
+  /* hypercubic_bond_percolation<3, 7> periodic_perc(0.2488);
+  periodic_perc.set_boundary_condition(boundary_condition::periodic);
+  periodic_perc.run_wrapping_simulations("test4", 1000, 8); */
+
+  // Flattening first makes every later lookup a single step, when analysing one configuration several times
+  /* perc.generate_clusters_parallel(4);
+  perc.flatten(4);
+  perc.write_clusters_data(1, 64);
+  perc.plot_clusters(10000, 10, "plot6"); */
+
+  return 0;
+}
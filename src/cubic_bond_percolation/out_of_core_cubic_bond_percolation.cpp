@@ -0,0 +1,308 @@
+#include <algorithm>
+#include <atomic>
+#include <print>
+#include <random>
+#include <stdint.h>
+#include <thread>
+
+#include <sys/mman.h>
+
+#include "out_of_core_cubic_bond_percolation.h"
+
+#include "checkpoint.h"
+#include "cluster_histogram.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "power.h"
+#include "results_file.h"
+#include "timer.h"
+
+using node = out_of_core_cubic_bond_percolation::node;
+
+// Find root with path halving, in either a slab forest or the forest of the whole cube
+static force_inline size_t find_root(node* nodes, size_t index)
+{
+  while (!nodes[index].is_root(index))
+  {
+    const size_t parent = nodes[index].parent(index);
+    if (nodes[parent].is_root(parent))
+    {
+      return parent;
+    }
+
+    const size_t grandparent = nodes[parent].parent(parent);
+    nodes[index].set_parent(grandparent);
+    index = grandparent;
+  }
+  return index;
+}
+
+static force_inline void merge(node* nodes, size_t index1, size_t index2)
+{
+  const size_t root1 = find_root(nodes, index1);
+  const size_t root2 = find_root(nodes, index2);
+
+  if (root1 == root2)
+  {
+    return;
+  }
+
+  const int64_t size1 = nodes[root1].cluster_size();
+  const int64_t size2 = nodes[root2].cluster_size();
+  const int64_t size = (std::abs(size1) + std::abs(size2)) * (1 - 2 * (size1 < 0 || size2 < 0));
+
+  if (std::abs(size1) < std::abs(size2))
+  {
+    nodes[root1].set_parent(root2);
+    nodes[root2].make_root(root2, size);
+  }
+  else
+  {
+    nodes[root2].set_parent(root1);
+    nodes[root1].make_root(root1, size);
+  }
+}
+
+out_of_core_cubic_bond_percolation::out_of_core_cubic_bond_percolation(uint8_t cube_pow, double p, size_t memory_budget, const std::string& directory)
+    : _cube_pow(cube_pow), _cube_size(ipow(2, cube_pow)), _plane_size(ipow(size_t(2), 2u * cube_pow)), _row_words((_cube_size + 63) / 64),
+      _memory_budget(memory_budget), _probability(p), _sampler(p), _rng(pcg_extras::seed_seq_from<std::random_device>{}),
+      _forest(ipow(size_t(2), 3u * cube_pow), directory)
+{
+}
+
+void out_of_core_cubic_bond_percolation::set_probability(double p)
+{
+  _probability = p;
+  _sampler.set_probability(p);
+}
+
+void out_of_core_cubic_bond_percolation::set_bond_sampling(bond_sampling mode)
+{
+  _sampler.set_mode(mode);
+}
+
+// Thickest slabs such that every thread has one and num_threads of them fit in the memory budget
+size_t out_of_core_cubic_bond_percolation::slab_planes(uint8_t num_threads) const
+{
+  const size_t planes = _memory_budget / (num_threads * _plane_size * sizeof(node));
+  return std::clamp<size_t>(planes, 1, (_cube_size + num_threads - 1) / num_threads);
+}
+
+cluster_histogram out_of_core_cubic_bond_percolation::generate_clusters(uint8_t num_threads, size_t central_cube_size)
+{
+  const size_t planes = slab_planes(num_threads);
+  const size_t num_slabs = (_cube_size + planes - 1) / planes;
+
+  cluster_histogram results;
+  _face_central_sites.clear();
+
+  std::atomic<size_t> next_slab = 0;
+  std::vector<std::thread> threads;
+  for (uint8_t thread = 0; thread < num_threads; ++thread)
+  {
+    threads.emplace_back(
+        [&]()
+        {
+          pcg64_fast rng(pcg_extras::seed_seq_from<std::random_device>{});
+          std::vector<node> slab(planes * _plane_size);
+          cluster_histogram thread_results;
+
+          for (size_t slab_index = next_slab++; slab_index < num_slabs; slab_index = next_slab++)
+          {
+            const size_t start_i = slab_index * planes;
+            generate_slab(rng, slab, start_i, std::min<size_t>(start_i + planes, _cube_size), central_cube_size, thread_results);
+          }
+
+          std::lock_guard lock(_mutex);
+          merge_histograms(results, thread_results);
+        });
+  }
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  for (size_t slab_index = 1; slab_index < num_slabs; ++slab_index)
+  {
+    merge_slabs(slab_index * planes);
+  }
+
+  // Clusters reaching a face are only complete now, so gather their central sites by final root
+  std::unordered_map<size_t, uint64_t> central_sites;
+  for (auto [root, count] : _face_central_sites)
+  {
+    central_sites[find_root(_forest.data(), root)] += count;
+  }
+  for (auto [root, count] : central_sites)
+  {
+    add_to_histogram(results, _forest[root].cluster_size(), count);
+  }
+
+  return results;
+}
+
+/*
+Build the forest of planes [start_i, end_i) in slab, with bonds drawn in the same order as cubic_bond_percolation::generate_row, then
+write it to the file. Clusters not reaching a face of the slab are complete, so their central sites go straight into results.
+*/
+void out_of_core_cubic_bond_percolation::generate_slab(pcg64_fast& rng, std::vector<node>& slab, size_t start_i, size_t end_i,
+                                                       size_t central_cube_size, cluster_histogram& results)
+{
+  const size_t offset = get_index(start_i, 0, 0);
+  const size_t slab_size = (end_i - start_i) * _plane_size;
+  const size_t last_face = slab_size - _plane_size;
+  node* const nodes = slab.data();
+
+  std::vector<uint64_t> bonds(3 * _row_words);
+  uint64_t* const k_bonds = bonds.data();
+  uint64_t* const j_bonds = bonds.data() + _row_words;
+  uint64_t* const i_bonds = bonds.data() + 2 * _row_words;
+
+  for (size_t i = start_i; i < end_i; ++i)
+  {
+    const bool i_boundary = i == 0 || i == _cube_size - 1;
+
+    for (uint32_t j = 0; j < _cube_size; ++j)
+    {
+      const size_t row = get_index(i, j, 0) - offset;
+      const bool j_boundary = i_boundary || j == 0 || j == _cube_size - 1;
+
+      for (uint32_t k = 0; k < _cube_size; ++k)
+      {
+        nodes[row + k].make_root(row + k, 1 - 2 * (j_boundary || k == 0 || k == _cube_size - 1));
+      }
+
+      _sampler.fill(rng, k_bonds, _cube_size);
+      _sampler.fill(rng, j_bonds, _cube_size);
+      _sampler.fill(rng, i_bonds, _cube_size);
+
+      k_bonds[0] &= ~uint64_t(1);
+      for_each_set_bit(k_bonds, _row_words, [&](size_t k) { merge(nodes, row + k - 1, row + k); });
+
+      if (j > 0)
+      {
+        for_each_set_bit(j_bonds, _row_words, [&](size_t k) { merge(nodes, row - _cube_size + k, row + k); });
+      }
+      if (i > start_i)
+      {
+        for_each_set_bit(i_bonds, _row_words, [&](size_t k) { merge(nodes, row - _plane_size + k, row + k); });
+      }
+    }
+  }
+
+  // Move the root of every cluster reaching a face onto that face, so merges between slabs only touch faces
+  const auto on_face = [&](size_t index) { return index < _plane_size || index >= last_face; };
+  const auto relocate_root = [&](size_t index)
+  {
+    const size_t root = find_root(nodes, index);
+    if (!on_face(root))
+    {
+      nodes[index].make_root(index, nodes[root].cluster_size());
+      nodes[root].set_parent(index);
+    }
+  };
+  for (size_t index = 0; index < _plane_size; ++index)
+  {
+    relocate_root(index);
+  }
+  for (size_t index = last_face; index < slab_size; ++index)
+  {
+    relocate_root(index);
+  }
+
+  // Write out with every node pointing straight at its root, counting central sites by root on the way
+  const size_t min_coordinate = (_cube_size - central_cube_size) / 2;
+  const size_t max_coordinate = (_cube_size + central_cube_size) / 2;
+  std::unordered_map<size_t, uint64_t> central_sites;
+
+  node* const output = _forest.data() + offset;
+  for (size_t index = 0; index < slab_size; ++index)
+  {
+    const size_t root = find_root(nodes, index);
+    if (root == index)
+    {
+      output[index].make_root(offset + index, nodes[index].cluster_size());
+    }
+    else
+    {
+      output[index].set_parent(offset + root);
+    }
+
+    const size_t i = start_i + (index >> (2 * _cube_pow));
+    const size_t j = (index >> _cube_pow) & (_cube_size - 1);
+    const size_t k = index & (_cube_size - 1);
+    if (i >= min_coordinate && i < max_coordinate && j >= min_coordinate && j < max_coordinate && k >= min_coordinate && k < max_coordinate)
+    {
+      ++central_sites[root];
+    }
+  }
+
+  _forest.flush(offset, slab_size);
+  _forest.advise(offset, slab_size, MADV_DONTNEED);
+
+  for (auto [root, count] : central_sites)
+  {
+    if (on_face(root))
+    {
+      std::lock_guard lock(_mutex);
+      _face_central_sites[offset + root] += count;
+    }
+    else
+    {
+      add_to_histogram(results, nodes[root].cluster_size(), count);
+    }
+  }
+}
+
+// Merge along the open bonds between planes i - 1 and i, the faces of neighbouring slabs
+void out_of_core_cubic_bond_percolation::merge_slabs(size_t i)
+{
+  const size_t previous_face = get_index(i - 1, 0, 0);
+  const size_t face = get_index(i, 0, 0);
+
+  _forest.advise(previous_face, 2 * _plane_size, MADV_SEQUENTIAL);
+  _forest.advise(previous_face, 2 * _plane_size, MADV_WILLNEED);
+
+  std::vector<uint64_t> bonds(_row_words);
+  for (uint32_t j = 0; j < _cube_size; ++j)
+  {
+    const size_t row = static_cast<size_t>(j) << _cube_pow;
+
+    _sampler.fill(_rng, bonds.data(), _cube_size);
+    for_each_set_bit(bonds.data(), _row_words, [&](size_t k) { merge(_forest.data(), face + row + k, previous_face + row + k); });
+  }
+
+  _forest.advise(previous_face, 2 * _plane_size, MADV_NORMAL);
+}
+
+cluster_root out_of_core_cubic_bond_percolation::get_root(int i, int j, int k) const
+{
+  size_t index = get_index(i, j, k);
+  while (!_forest[index].is_root(index))
+  {
+    index = _forest[index].parent(index);
+  }
+  return {index, _forest[index].cluster_size()};
+}
+
+void out_of_core_cubic_bond_percolation::run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size,
+                                                         uint8_t num_threads)
+{
+  std::println("Running {} out of core simulations with size {} for p={}, {} planes per slab", num_simulations, _cube_size, _probability,
+               slab_planes(num_threads));
+
+  if (central_cube_size > _cube_size)
+  {
+    std::println("Central cube larger than simulation");
+    return;
+  }
+
+  const results_header header = make_results_header("out_of_core_cubic_bond_percolation", _probability, central_cube_size, _cube_size);
+  const std::filesystem::path path = results_path(folder_name, header);
+  const cluster_histogram results =
+      run_checkpointed_simulations(path, header, num_simulations, _rng, [&](uint32_t) { return generate_clusters(num_threads, central_cube_size); });
+
+  write_histogram_csv(folder_name, "out_of_core_cubic_bond_percolation", _probability, central_cube_size, _cube_size, num_simulations, results);
+
+  std::println("Completed {} out of core simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+}
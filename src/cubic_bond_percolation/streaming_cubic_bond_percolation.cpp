@@ -0,0 +1,274 @@
+#include <algorithm>
+#include <array>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <limits>
+#include <print>
+#include <random>
+#include <stdint.h>
+
+#include "streaming_cubic_bond_percolation.h"
+
+#include "checkpoint.h"
+#include "cluster_histogram.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "power.h"
+#include "results_file.h"
+#include "timer.h"
+
+streaming_cubic_bond_percolation::streaming_cubic_bond_percolation(uint8_t cube_pow, double p)
+    : _cube_pow(cube_pow), _cube_size(ipow(2, cube_pow)), _plane_size(ipow(size_t(2), 2u * cube_pow)), _row_words((_cube_size + 63) / 64),
+      _probability(p), _sampler(p), _rng(pcg_extras::seed_seq_from<std::random_device>{}), _labels(2 * _plane_size), _central_sites(2 * _plane_size),
+      _faces(2 * _plane_size)
+{
+}
+
+void streaming_cubic_bond_percolation::set_probability(double p)
+{
+  _probability = p;
+  _sampler.set_probability(p);
+}
+
+void streaming_cubic_bond_percolation::set_bond_sampling(bond_sampling mode)
+{
+  _sampler.set_mode(mode);
+}
+
+cluster_histogram streaming_cubic_bond_percolation::simulate(size_t central_cube_size)
+{
+  cluster_histogram results;
+
+  const uint32_t min_coordinate = (_cube_size - central_cube_size) / 2;
+  const uint32_t max_coordinate = (_cube_size + central_cube_size) / 2;
+
+  std::vector<uint64_t> bonds(3 * _row_words);
+
+  for (uint32_t i = 0; i < _cube_size; ++i)
+  {
+    const size_t current_plane = (i % 2) * _plane_size;
+    const size_t previous_plane = _plane_size - current_plane;
+
+    sweep_plane(i, min_coordinate, max_coordinate, bonds.data());
+
+    if (i > 0)
+    {
+      relocate_roots(current_plane, previous_plane);
+      emit_roots(previous_plane, results);
+    }
+  }
+
+  // Whatever is left touches the last plane, so is on the boundary anyway
+  emit_roots(((_cube_size - 1) % 2) * _plane_size, results);
+
+  return results;
+}
+
+/*
+After every plane, the clusters rooted in it are checked for one touching both faces. A cluster still rooted in the previous plane
+once the roots are relocated did not reach this plane, so its faces are those already checked with the previous plane. Along the
+sweep, a cluster can only span while some cluster of the current plane touches the first plane.
+*/
+std::pair<bool, uint32_t> streaming_cubic_bond_percolation::simulate_spanning(spanning_axis axis)
+{
+  const uint8_t spanning_faces = face(axis, false) | face(axis, true);
+
+  // No site is in the central cube
+  const uint32_t min_coordinate = _cube_size / 2;
+  const uint32_t max_coordinate = _cube_size / 2;
+
+  std::vector<uint64_t> bonds(3 * _row_words);
+
+  for (uint32_t i = 0; i < _cube_size; ++i)
+  {
+    const size_t current_plane = (i % 2) * _plane_size;
+    const size_t previous_plane = _plane_size - current_plane;
+
+    sweep_plane(i, min_coordinate, max_coordinate, bonds.data());
+
+    if (i > 0)
+    {
+      relocate_roots(current_plane, previous_plane);
+    }
+
+    const auto [spans, live_faces] = scan_faces(current_plane, spanning_faces);
+    if (spans)
+    {
+      return {true, i + 1};
+    }
+    if (axis == spanning_axis::i && !(live_faces & face(spanning_axis::i, false)))
+    {
+      return {false, i + 1};
+    }
+  }
+
+  return {false, _cube_size};
+}
+
+// Make labels for plane i, then merge along the open bonds within it and to the previous plane
+void streaming_cubic_bond_percolation::sweep_plane(uint32_t i, uint32_t min_coordinate, uint32_t max_coordinate, uint64_t* bonds)
+{
+  const size_t current_plane = (i % 2) * _plane_size;
+  const size_t previous_plane = _plane_size - current_plane;
+
+  uint64_t* const k_bonds = bonds;
+  uint64_t* const j_bonds = bonds + _row_words;
+  uint64_t* const i_bonds = bonds + 2 * _row_words;
+
+  const bool i_boundary = i == 0 || i == _cube_size - 1;
+  const bool i_central = i >= min_coordinate && i < max_coordinate;
+  const uint8_t i_faces = (i == 0) * face(spanning_axis::i, false) | (i == _cube_size - 1) * face(spanning_axis::i, true);
+
+  for (uint32_t j = 0; j < _cube_size; ++j)
+  {
+    const size_t row = (static_cast<size_t>(j) << _cube_pow);
+    const bool j_boundary = i_boundary || j == 0 || j == _cube_size - 1;
+    const bool j_central = i_central && j >= min_coordinate && j < max_coordinate;
+    const uint8_t j_faces = i_faces | (j == 0) * face(spanning_axis::j, false) | (j == _cube_size - 1) * face(spanning_axis::j, true);
+
+    for (uint32_t k = 0; k < _cube_size; ++k)
+    {
+      const size_t index = current_plane + row + k;
+      const bool on_boundary = j_boundary || k == 0 || k == _cube_size - 1;
+      _labels[index].make_root(index, 1 - 2 * on_boundary);
+      _central_sites[index] = j_central && k >= min_coordinate && k < max_coordinate;
+      _faces[index] = j_faces | (k == 0) * face(spanning_axis::k, false) | (k == _cube_size - 1) * face(spanning_axis::k, true);
+    }
+
+    // Same draws as cubic_bond_percolation::generate_row
+    _sampler.fill(_rng, k_bonds, _cube_size);
+    _sampler.fill(_rng, j_bonds, _cube_size);
+    _sampler.fill(_rng, i_bonds, _cube_size);
+
+    k_bonds[0] &= ~uint64_t(1);
+    for_each_set_bit(k_bonds, _row_words, [&](size_t k) { merge(current_plane + row + k - 1, current_plane + row + k); });
+
+    if (j > 0)
+    {
+      const size_t previous_row = row - _cube_size;
+      for_each_set_bit(j_bonds, _row_words, [&](size_t k) { merge(current_plane + previous_row + k, current_plane + row + k); });
+    }
+    if (i > 0)
+    {
+      for_each_set_bit(i_bonds, _row_words, [&](size_t k) { merge(previous_plane + row + k, current_plane + row + k); });
+    }
+  }
+}
+
+/*
+Move the root of every cluster reaching the current plane into the current plane, and point every label of the current plane
+directly at its root. Afterwards no label of the current plane refers to the previous one, so the previous plane can be reused,
+and any root left in the previous plane belongs to a cluster which did not reach the current plane.
+*/
+void streaming_cubic_bond_percolation::relocate_roots(size_t current_plane, size_t previous_plane)
+{
+  for (size_t index = current_plane; index < current_plane + _plane_size; ++index)
+  {
+    size_t root = find_root(index);
+
+    if (root >= previous_plane && root < previous_plane + _plane_size)
+    {
+      // This label becomes the root, with everything else in the cluster reaching it through the old root
+      _labels[index].make_root(index, _labels[root].cluster_size());
+      _central_sites[index] = _central_sites[root];
+      _faces[index] = _faces[root];
+      _labels[root].set_parent(index);
+      root = index;
+    }
+
+    if (root != index)
+    {
+      _labels[index].set_parent(root);
+    }
+  }
+}
+
+// Add every cluster with a root in the plane to the histogram
+void streaming_cubic_bond_percolation::emit_roots(size_t plane, cluster_histogram& results) const
+{
+  for (size_t index = plane; index < plane + _plane_size; ++index)
+  {
+    if (_labels[index].is_root(index) && _central_sites[index] > 0)
+    {
+      add_to_histogram(results, _labels[index].cluster_size(), _central_sites[index]);
+    }
+  }
+}
+
+// Whether a cluster with a root in the plane touches both of spanning_faces, and the faces touched by any of these clusters
+std::pair<bool, uint8_t> streaming_cubic_bond_percolation::scan_faces(size_t plane, uint8_t spanning_faces) const
+{
+  bool spans = false;
+  uint8_t faces = 0;
+  for (size_t index = plane; index < plane + _plane_size; ++index)
+  {
+    if (_labels[index].is_root(index))
+    {
+      spans |= (_faces[index] & spanning_faces) == spanning_faces;
+      faces |= _faces[index];
+    }
+  }
+  return {spans, faces};
+}
+
+void streaming_cubic_bond_percolation::run_simulations(const std::string& folder_name, uint32_t num_simulations, size_t central_cube_size)
+{
+  std::println("Running {} streaming simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+
+  if (central_cube_size > _cube_size)
+  {
+    std::println("Central cube larger than simulation");
+    return;
+  }
+
+  const results_header header = make_results_header("streaming_cubic_bond_percolation", _probability, central_cube_size, _cube_size);
+  const std::filesystem::path path = results_path(folder_name, header);
+  const cluster_histogram results =
+      run_checkpointed_simulations(path, header, num_simulations, _rng, [&](uint32_t) { return simulate(central_cube_size); });
+
+  write_histogram_csv(folder_name, "streaming_cubic_bond_percolation", _probability, central_cube_size, _cube_size, num_simulations, results);
+
+  std::println("Completed {} streaming simulations with size {} for p={}", num_simulations, _cube_size, _probability);
+}
+
+spanning_estimate streaming_cubic_bond_percolation::run_spanning_simulations(const std::string& folder_name, uint32_t num_simulations,
+                                                                             spanning_axis axis)
+{
+  static constexpr std::array<char, 3> axis_names = {'i', 'j', 'k'};
+  const char axis_name = axis_names[static_cast<size_t>(axis)];
+
+  std::println("Running {} spanning simulations along {} with size {} for p={}", num_simulations, axis_name, _cube_size, _probability);
+  timer tm;
+
+  spanning_estimate estimate;
+  for (uint32_t simulation_count = 0; simulation_count < num_simulations; ++simulation_count)
+  {
+    tm.restart();
+    const auto [spans, planes_swept] = simulate_spanning(axis);
+    tm.stop();
+
+    const double ms = tm.get_ns() / 1e6;
+    ++estimate.num_runs;
+    estimate.num_spanning += spans;
+    estimate.planes_swept += planes_swept;
+    estimate.sum_ms += ms;
+    estimate.sum_squared_ms += ms * ms;
+  }
+
+  const std::filesystem::path path = std::format("src/analyse_data/data/{}/cubic_bond_percolation_spanning_{}_p_{:.10f}_size_{}_num_{}.csv",
+                                                 folder_name, axis_name, _probability, _cube_size, num_simulations);
+  std::filesystem::create_directories(path.parent_path());
+  std::ofstream data_file(path);
+
+  data_file << "probability, simulation size, axis, number of simulations\n";
+  data_file << std::format("{:.10f}, {}, {}, {}\n", _probability, _cube_size, axis_name, num_simulations);
+  data_file << "\nnumber spanning,spanning probability,standard error,mean planes swept,mean ms,stddev ms\n";
+  data_file << std::format("{}, {:.10f}, {:.10f}, {:.3f}, {:.3f}, {:.3f}\n", estimate.num_spanning, estimate.probability(),
+                           estimate.standard_error(), estimate.mean_planes(), estimate.mean_ms(), estimate.stddev_ms());
+
+  std::println("Spanning probability {:.6f} +- {:.6f}, sweeping {:.1f} of {} planes in {:.3f} ms on average", estimate.probability(),
+               estimate.standard_error(), estimate.mean_planes(), _cube_size, estimate.mean_ms());
+
+  return estimate;
+}
@@ -0,0 +1,148 @@
+#include <filesystem>
+#include <format>
+#include <map>
+#include <memory>
+#include <print>
+#include <stdexcept>
+#include <stdint.h>
+#include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
+
+#include "cluster_histogram.h"
+#include "results_file.h"
+
+/*
+Tool for the binary results files, see results_file.h:
+
+  merge_results merge <output> <input>...   Append the records of the inputs to output, which must all be of the same run.
+                                            For counter-based runs, records of a simulation id already in output are skipped.
+  merge_results csv <folder> <input>...     Sum the records of each distinct run among the inputs and write its histogram to
+                                            src/analyse_data/data/<folder>/, in the same CSV format as run_simulations.
+  merge_results info <input>...             Print the parameters and number of records of each input.
+*/
+
+static void merge(const std::filesystem::path& output_path, const std::vector<std::filesystem::path>& input_paths)
+{
+  std::unique_ptr<results_writer> output;
+  std::unordered_set<uint64_t> simulations;
+
+  if (std::filesystem::exists(output_path))
+  {
+    const results_reader existing(output_path);
+    output = std::make_unique<results_writer>(output_path, existing.header());
+    for (size_t record = 0; record < existing.size(); ++record)
+    {
+      simulations.insert(existing.simulation_id(record));
+    }
+  }
+
+  size_t num_merged = 0;
+  size_t num_skipped = 0;
+  for (const std::filesystem::path& input_path : input_paths)
+  {
+    const results_reader input(input_path);
+    if (!output)
+    {
+      output = std::make_unique<results_writer>(output_path, input.header());
+    }
+    else if (!output->header().same_run(input.header()))
+    {
+      throw std::runtime_error(std::format("{} holds a different run from {}", input_path.string(), output_path.string()));
+    }
+
+    for (size_t record = 0; record < input.size(); ++record)
+    {
+      // Without a campaign seed, simulation ids are only counters within each run and may repeat
+      if (input.header().campaign_seed != 0 && !simulations.insert(input.simulation_id(record)).second)
+      {
+        ++num_skipped;
+        continue;
+      }
+
+      output->append(input.simulation_id(record), input.histogram(record));
+      ++num_merged;
+    }
+  }
+
+  std::println("Merged {} records into {}, skipped {} already present", num_merged, output_path.string(), num_skipped);
+}
+
+static void write_csv(const std::string& folder_name, const std::vector<std::filesystem::path>& input_paths)
+{
+  // Summed histogram and number of simulations by run
+  using run = std::tuple<std::string, double, uint64_t, uint64_t>;
+  std::map<run, std::pair<cluster_histogram, uint64_t>> runs;
+
+  for (const std::filesystem::path& input_path : input_paths)
+  {
+    const results_reader input(input_path);
+    const results_header& header = input.header();
+    auto& [results, num_simulations] = runs[{header.model(), header.probability, header.central_cube_size, header.cube_size}];
+
+    for (size_t record = 0; record < input.size(); ++record)
+    {
+      merge_histograms(results, input.histogram(record));
+    }
+    num_simulations += input.size();
+  }
+
+  for (const auto& [parameters, summed] : runs)
+  {
+    const auto& [model_name, probability, central_cube_size, cube_size] = parameters;
+    write_histogram_csv(folder_name, model_name, probability, central_cube_size, cube_size, summed.second, summed.first);
+    std::println("{} p={:.10f} centre={} size={}: {} simulations", model_name, probability, central_cube_size, cube_size, summed.second);
+  }
+}
+
+static void print_info(const std::vector<std::filesystem::path>& input_paths)
+{
+  for (const std::filesystem::path& input_path : input_paths)
+  {
+    const results_reader input(input_path);
+    const results_header& header = input.header();
+    std::println("{}: {} p={:.10f} centre={} size={} seed={} records={}", input_path.string(), header.model(), header.probability,
+                 header.central_cube_size, header.cube_size, header.campaign_seed, input.size());
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    std::println("Usage: {} merge <output> <input>... | csv <folder> <input>... | info <input>...", argv[0]);
+    return 1;
+  }
+
+  const std::string command = argv[1];
+  std::vector<std::filesystem::path> paths(argv + 2, argv + argc);
+
+  try
+  {
+    if (command == "merge" && paths.size() >= 2)
+    {
+      merge(paths.front(), std::vector<std::filesystem::path>(paths.begin() + 1, paths.end()));
+    }
+    else if (command == "csv" && paths.size() >= 2)
+    {
+      write_csv(paths.front().string(), std::vector<std::filesystem::path>(paths.begin() + 1, paths.end()));
+    }
+    else if (command == "info")
+    {
+      print_info(paths);
+    }
+    else
+    {
+      std::println("Unknown command or missing arguments: {}", command);
+      return 1;
+    }
+  }
+  catch (const std::exception& error)
+  {
+    std::println("{}", error.what());
+    return 1;
+  }
+
+  return 0;
+}
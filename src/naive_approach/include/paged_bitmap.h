@@ -0,0 +1,223 @@
+#pragma once
+
+#define force_inline inline __attribute__((always_inline))
+
+#include <array>
+#include <memory>
+#include <stdint.h>
+#include <tuple>
+#include <vector>
+
+#include "flat_hash_map.hpp"
+
+/*
+Site of Z^3 packed into a single word, 21 bits per coordinate offset by 2^20, x highest. Moving to a neighbour is then a single
+addition of one of the stencil offsets, which never carries into the next coordinate as long as every coordinate stays inside
+[-2^20, 2^20). on_edge tells when a site gets to the edge of that range.
+*/
+class packed_site
+{
+public:
+  static constexpr int coordinate_bits = 21;
+  static constexpr uint64_t coordinate_mask = (uint64_t(1) << coordinate_bits) - 1;
+  static constexpr int64_t bias = int64_t(1) << (coordinate_bits - 1);
+
+  // Offsets to the six nearest neighbours
+  static constexpr std::array<uint64_t, 6> stencil = {
+      uint64_t(1),
+      uint64_t(-1),
+      uint64_t(1) << coordinate_bits,
+      uint64_t(-1) << coordinate_bits,
+      uint64_t(1) << (2 * coordinate_bits),
+      uint64_t(-1) << (2 * coordinate_bits),
+  };
+
+  static constexpr uint64_t pack(int x, int y, int z)
+  {
+    return static_cast<uint64_t>(x + bias) << (2 * coordinate_bits) | static_cast<uint64_t>(y + bias) << coordinate_bits |
+           static_cast<uint64_t>(z + bias);
+  }
+
+  static constexpr std::tuple<int, int, int> unpack(uint64_t site)
+  {
+    return {static_cast<int>(static_cast<int64_t>(site >> (2 * coordinate_bits) & coordinate_mask) - bias),
+            static_cast<int>(static_cast<int64_t>(site >> coordinate_bits & coordinate_mask) - bias),
+            static_cast<int>(static_cast<int64_t>(site & coordinate_mask) - bias)};
+  }
+
+  // Whether some neighbour of site is outside the range of the packing
+  static force_inline bool on_edge(uint64_t site)
+  {
+    bool result = false;
+    for (int shift = 0; shift < 3 * coordinate_bits; shift += coordinate_bits)
+    {
+      const uint64_t coordinate = site >> shift & coordinate_mask;
+      result |= coordinate == 0 || coordinate == coordinate_mask;
+    }
+    return result;
+  }
+};
+
+/*
+Set of packed sites as a bitmap in blocks of 32^3 sites (4 KiB), allocated when a site in them is first set, so memory follows the
+sites set rather than their bounding box: a bit per site for compact clusters, and at worst a block per site for very sparse ones.
+Blocks are found through a hash map from the block coordinates, with the last block used cached, since the neighbours looked up in a
+row usually share a block.
+*/
+class paged_bitmap
+{
+public:
+  static constexpr int block_bits = 5; // Block side 2^5 = 32
+  static constexpr size_t block_words = (size_t(1) << (3 * block_bits)) / 64;
+
+  // Set the bit of site, returning whether it was set already
+  force_inline bool test_and_set(uint64_t site)
+  {
+    uint64_t* const words = block(block_key(site));
+    const size_t bit = bit_index(site);
+    const uint64_t mask = uint64_t(1) << (bit % 64);
+
+    const bool was_set = words[bit / 64] & mask;
+    words[bit / 64] |= mask;
+    return was_set;
+  }
+
+  void clear()
+  {
+    _directory.clear();
+    _blocks.clear();
+    _last_key = no_block;
+  }
+
+  size_t num_blocks() const
+  {
+    return _blocks.size();
+  }
+
+  size_t memory_bytes() const
+  {
+    return _blocks.size() * sizeof(block_storage);
+  }
+
+  // Call f(site) for every site set, block by block
+  template <typename function>
+  void for_each(function&& f) const
+  {
+    for (const auto& [key, index] : _directory)
+    {
+      const block_storage& words = *_blocks[index];
+      for (size_t word = 0; word < block_words; ++word)
+      {
+        for (uint64_t bits = words[word]; bits != 0; bits &= bits - 1)
+        {
+          f(site_of(key, word * 64 + __builtin_ctzll(bits)));
+        }
+      }
+    }
+  }
+
+private:
+  using block_storage = std::array<uint64_t, block_words>;
+
+  static constexpr uint64_t no_block = ~uint64_t(0);
+  static constexpr uint64_t in_block_mask = (uint64_t(1) << block_bits) - 1;
+
+  // Site with the low block_bits bits of every coordinate cleared
+  static force_inline uint64_t block_key(uint64_t site)
+  {
+    constexpr uint64_t low_bits = in_block_mask | in_block_mask << packed_site::coordinate_bits | in_block_mask << (2 * packed_site::coordinate_bits);
+    return site & ~low_bits;
+  }
+
+  static force_inline size_t bit_index(uint64_t site)
+  {
+    return (site >> (2 * packed_site::coordinate_bits) & in_block_mask) << (2 * block_bits) |
+           (site >> packed_site::coordinate_bits & in_block_mask) << block_bits | (site & in_block_mask);
+  }
+
+  static uint64_t site_of(uint64_t key, size_t bit)
+  {
+    return key | (bit >> (2 * block_bits)) << (2 * packed_site::coordinate_bits) | (bit >> block_bits & in_block_mask) << packed_site::coordinate_bits |
+           (bit & in_block_mask);
+  }
+
+  force_inline uint64_t* block(uint64_t key)
+  {
+    if (key != _last_key)
+    {
+      auto [entry, inserted] = _directory.emplace(key, _blocks.size());
+      if (inserted)
+      {
+        _blocks.push_back(std::make_unique<block_storage>()); // Zeroed
+      }
+      _last_key = key;
+      _last_block = _blocks[entry->second]->data();
+    }
+    return _last_block;
+  }
+
+  ska::flat_hash_map<uint64_t, uint32_t> _directory; // Block key to index in _blocks
+  std::vector<std::unique_ptr<block_storage>> _blocks;
+
+  uint64_t _last_key = no_block;
+  uint64_t* _last_block = nullptr;
+};
+
+/*
+FIFO queue of packed sites in a power of two ring buffer, doubling when full. Unlike std::queue, popping never frees and pushing only
+allocates while the queue is growing past its largest size so far.
+*/
+class site_ring_buffer
+{
+public:
+  site_ring_buffer() : _sites(1024)
+  {
+  }
+
+  bool empty() const
+  {
+    return _head == _tail;
+  }
+
+  size_t size() const
+  {
+    return _tail - _head;
+  }
+
+  force_inline void push(uint64_t site)
+  {
+    if (size() == _sites.size())
+    {
+      grow();
+    }
+    _sites[_tail++ & (_sites.size() - 1)] = site;
+  }
+
+  force_inline uint64_t pop()
+  {
+    return _sites[_head++ & (_sites.size() - 1)];
+  }
+
+  void clear()
+  {
+    _head = 0;
+    _tail = 0;
+  }
+
+private:
+  void grow()
+  {
+    std::vector<uint64_t> sites(2 * _sites.size());
+    for (size_t index = _head; index < _tail; ++index)
+    {
+      sites[index - _head] = _sites[index & (_sites.size() - 1)];
+    }
+    _tail -= _head;
+    _head = 0;
+    _sites = std::move(sites);
+  }
+
+  std::vector<uint64_t> _sites;
+  size_t _head = 0; // Positions keep counting up, and wrap by masking
+  size_t _tail = 0;
+};
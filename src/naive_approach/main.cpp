@@ -17,19 +17,17 @@
 
 #define force_inline inline __attribute__((always_inline))
 
-#include <algorithm>
-#include <boost/container_hash/hash.hpp>
 #include <limits>
+#include <memory>
 #include <print>
-#include <queue>
 #include <random>
-#include <set>
 #include <stdint.h>
-#include <unordered_set>
+#include <tuple>
+#include <vector>
 
 #include "gnuplot-iostream.h"
 
-#include "flat_hash_map.hpp"
+#include "paged_bitmap.h"
 #include "pcg_extras.hpp"
 #include "pcg_random.hpp"
 #include "timer.h"
@@ -39,105 +37,97 @@ class percolation
 public:
   percolation(double p) : _p(p), _bound(std::numeric_limits<uint64_t>::max() * p), _rng(pcg_extras::seed_seq_from<std::random_device>{})
   {
-    _neighbours.push({0, 0, 0});
-
-    _gp << "set xrange [-50:50]" << std::endl;
-    _gp << "set yrange [-50:50]" << std::endl;
-    _gp << "set zrange [-50:50]" << std::endl;
-
-    _gp << "splot NaN" << std::endl;
-  }
-
-  force_inline std::vector<std::tuple<int, int, int>> get_possible_neighbours(const std::tuple<int, int, int>& node)
-  {
-    return {
-        {    std::get<0>(node),     std::get<1>(node), std::get<2>(node) + 1},
-        {    std::get<0>(node),     std::get<1>(node), std::get<2>(node) - 1},
-        {    std::get<0>(node), std::get<1>(node) + 1,     std::get<2>(node)},
-        {    std::get<0>(node), std::get<1>(node) - 1,     std::get<2>(node)},
-        {std::get<0>(node) + 1,     std::get<1>(node),     std::get<2>(node)},
-        {std::get<0>(node) - 1,     std::get<1>(node),     std::get<2>(node)},
-    };
   }
 
-  bool generate_cluster()
+  /*
+  Leath growth from the origin, breadth first. A site is marked in _visited as it joins the cluster, and its bonds are drawn when it
+  leaves the frontier, before the bitmap is looked up, so the bitmap is only looked up behind open bonds. A bond between two sites of
+  the cluster is then drawn from both ends, which is harmless since only a site not yet visited can join. Returns whether the
+  cluster terminated, rather than reaching max_sites sites or the edge of the packed coordinates.
+  */
+  bool generate_cluster(uint64_t max_sites = 1'000'000'000)
   {
     std::println("Generating cluster...");
-    // Almost all time is spent checking and inserting into _nodes.
-    while (_neighbours.size() != 0)
-    {
-      // Add next node to queue
-      auto next_node = _neighbours.front();
-      _neighbours.pop();
-      _nodes.insert(next_node);
+    _visited.clear();
+    _frontier.clear();
 
-      // Generate its neighbours
-      for (auto n : get_possible_neighbours(next_node))
-      {
-        bool res = _nodes.count(n);
-        if (!res && _rng() < _bound)
-        {
-          _neighbours.push(n);
-          _gp << "set arrow from " << std::get<0>(next_node) << ", " << std::get<1>(next_node) << ", " << std::get<2>(next_node) << " to "
-              << std::get<0>(n) << ", " << std::get<1>(n) << ", " << std::get<2>(n) << "nohead lw 0.2" << std::endl;
-        }
-      }
+    const uint64_t origin = packed_site::pack(0, 0, 0);
+    _visited.test_and_set(origin);
+    _frontier.push(origin);
+    _size = 1;
 
-      if (_nodes.size() % 1000 == 0)
+    while (!_frontier.empty())
+    {
+      const uint64_t site = _frontier.pop();
+      if (packed_site::on_edge(site) || _size > max_sites)
       {
-        _gp << "refresh" << std::endl;
+        std::println("Failed to terminate: {} sites, {} in the frontier", _size, _frontier.size());
+        return false;
       }
 
-      if (_nodes.size() > 1e5)
+      for (const uint64_t offset : packed_site::stencil)
       {
-        std::println("Failed to terminate: {}", _neighbours.size());
-
-        /* std::vector<std::tuple<int, int, int>> nb;
-        while (_neighbours.size() > 0)
+        if (_rng() < _bound && !_visited.test_and_set(site + offset))
         {
-          nb.push_back(_neighbours.front());
-          _neighbours.pop();
-        } */
+          _frontier.push(site + offset);
+          ++_size;
+        }
+      }
+    }
+
+    std::println("Generated cluster of size {}", _size);
+    return true;
+  }
 
-        /* Gnuplot gp;
+  uint64_t size() const
+  {
+    return _size;
+  }
 
-        gp << "set title 'test'\n";
+  size_t memory_bytes() const
+  {
+    return _visited.memory_bytes();
+  }
 
-        gp << "splot" << gp.file1d(nb) << "u 1:2:3 with points pt 7 ps 0.1 title 'test'" << std::endl; */
+  // Plot the sites of the last cluster grown, once growth is done
+  void plot_cluster() const
+  {
+    std::vector<std::tuple<int, int, int>> sites;
+    _visited.for_each([&](uint64_t site) { sites.push_back(packed_site::unpack(site)); });
 
-        //_tm.print_ms();
-        return false;
-      }
+    if (!_gp)
+    {
+      _gp = std::make_unique<Gnuplot>();
     }
-    std::println("Generated cluster of size {}", _nodes.size());
-    return true;
+    *_gp << "splot" << _gp->file1d(sites) << "u 1:2:3 with points pt 7 ps 0.1 title 'p=" << _p << "'" << std::endl;
   }
 
 private:
   const double _p;
   const uint64_t _bound;
-  ska::flat_hash_set<std::tuple<int, int, int>, boost::hash<std::tuple<int, int, int>>> _nodes; // All of the nodes in the cluster visited so far
-  std::queue<std::tuple<int, int, int>> _neighbours; // All of the immediate neighbours of the so far visited cluster
+  paged_bitmap _visited;      // All of the sites in the cluster so far
+  site_ring_buffer _frontier; // Sites of the cluster whose bonds are still to be drawn
+  uint64_t _size = 0;
   pcg64_fast _rng;
-  Gnuplot _gp;
-  // timer _tm;
+  mutable std::unique_ptr<Gnuplot> _gp; // Started on first plot
 };
 
 int main()
 {
-  timer tm;
-  tm.start();
   percolation p(0.248); // p(0.2488125); 2^8 = 256 2^9 = 512
-  tm.stop();
-  tm.print_ms();
-  // percolation p(0.248);
 
-  tm.restart();
+  timer tm;
+  tm.start();
   p.generate_cluster();
   tm.stop();
   tm.print_ms();
+  std::println("Bitmap of {} MiB", p.memory_bytes() >> 20);
 
-  // p.plot_clusters(10000, 10);
+  // Plotting is slow, and useless beyond a few hundred thousand points
+  if (p.size() <= 100'000)
+  {
+    p.plot_cluster();
+  }
 
   return 0;
 }
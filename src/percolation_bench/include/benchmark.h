@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <numeric>
+#include <print>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "timer.h"
+
+// Keep value (and everything it was computed from) alive without the compiler knowing what is done with it
+template <typename type>
+inline void do_not_optimize(const type& value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct benchmark_result
+{
+  std::string name;
+  std::string parameters;
+  double items; // Units of work per run, e.g. sites or calls, for throughput
+  std::vector<uint64_t> samples_ns;
+
+  uint64_t min_ns() const
+  {
+    return *std::min_element(samples_ns.begin(), samples_ns.end());
+  }
+
+  double median_ns() const
+  {
+    std::vector<uint64_t> sorted = samples_ns;
+    std::sort(sorted.begin(), sorted.end());
+    const size_t middle = sorted.size() / 2;
+    return sorted.size() % 2 ? sorted[middle] : (sorted[middle - 1] + sorted[middle]) / 2.0;
+  }
+
+  double mean_ns() const
+  {
+    return std::accumulate(samples_ns.begin(), samples_ns.end(), 0.0) / samples_ns.size();
+  }
+
+  // Sample standard deviation
+  double stddev_ns() const
+  {
+    if (samples_ns.size() < 2)
+    {
+      return 0;
+    }
+    const double mean = mean_ns();
+    double sum_squares = 0;
+    for (const uint64_t sample : samples_ns)
+    {
+      sum_squares += (sample - mean) * (sample - mean);
+    }
+    return std::sqrt(sum_squares / (samples_ns.size() - 1));
+  }
+};
+
+/*
+Runs each benchmark warm_up times untimed, then repetitions times timed, with an optional untimed setup before every run (to
+rebuild state the benchmark modifies). Results are printed as they come, with throughput taken from the median, and can be written
+out as JSON to compare runs across commits. Names and parameters are written to the JSON unescaped, so must not contain quotes.
+*/
+class benchmark_suite
+{
+public:
+  benchmark_suite(uint32_t warm_up, uint32_t repetitions) : _warm_up(warm_up), _repetitions(std::max<uint32_t>(repetitions, 1))
+  {
+  }
+
+  template <typename setup_function, typename body_function>
+  const benchmark_result& run(const std::string& name, const std::string& parameters, double items, setup_function&& setup,
+                              body_function&& body)
+  {
+    for (uint32_t warm_up_run = 0; warm_up_run < _warm_up; ++warm_up_run)
+    {
+      setup();
+      body();
+    }
+
+    benchmark_result result = {name, parameters, items, {}};
+    timer tm;
+    for (uint32_t repetition = 0; repetition < _repetitions; ++repetition)
+    {
+      setup();
+      tm.restart();
+      body();
+      tm.stop();
+      result.samples_ns.push_back(tm.get_ns());
+    }
+
+    std::println("{:<28} {:<28} {:>12.3f} {:>12.3f} {:>10.3f} {:>14.2f}", result.name, result.parameters, result.min_ns() / 1e6,
+                 result.median_ns() / 1e6, result.stddev_ns() / 1e6, items / (result.median_ns() / 1e3));
+
+    _results.push_back(std::move(result));
+    return _results.back();
+  }
+
+  template <typename body_function>
+  const benchmark_result& run(const std::string& name, const std::string& parameters, double items, body_function&& body)
+  {
+    return run(name, parameters, items, []() {}, std::forward<body_function>(body));
+  }
+
+  static void print_heading()
+  {
+    std::println("{:<28} {:<28} {:>12} {:>12} {:>10} {:>14}", "benchmark", "parameters", "min ms", "median ms", "stddev ms", "Mitems/s");
+  }
+
+  void write_json(const std::filesystem::path& path) const
+  {
+    std::ofstream file(path);
+    file << std::format("{{\n  \"warm_up\": {},\n  \"repetitions\": {},\n  \"results\": [", _warm_up, _repetitions);
+
+    for (size_t index = 0; index < _results.size(); ++index)
+    {
+      const benchmark_result& result = _results[index];
+
+      std::string samples;
+      for (const uint64_t sample : result.samples_ns)
+      {
+        samples += std::format("{}{}", samples.empty() ? "" : ", ", sample);
+      }
+
+      file << std::format("{}\n    {{\"name\": \"{}\", \"parameters\": \"{}\", \"items\": {}, \"min_ns\": {}, \"median_ns\": {}, "
+                          "\"mean_ns\": {}, \"stddev_ns\": {}, \"samples_ns\": [{}]}}",
+                          index == 0 ? "" : ",", result.name, result.parameters, result.items, result.min_ns(), result.median_ns(),
+                          result.mean_ns(), result.stddev_ns(), samples);
+    }
+
+    file << "\n  ]\n}\n";
+  }
+
+private:
+  const uint32_t _warm_up;
+  const uint32_t _repetitions;
+  std::vector<benchmark_result> _results;
+};
@@ -0,0 +1,663 @@
+#include <algorithm>
+#include <format>
+#include <optional>
+#include <limits>
+#include <print>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "benchmark.h"
+#include "cubic_bond_percolation.h"
+#include "numa_topology.h"
+#include "pcg_extras.hpp"
+#include "pcg_random.hpp"
+#include "perf_counters.h"
+#include "percolation.h"
+#include "power.h"
+#include "timer.h"
+#include "xorshift.h"
+
+/*
+Devirtualisation: compare the throughput of the cluster generation loop when the lattice mappings are resolved through the
+vtable of the percolation<element> adapter, against the same lattice plugged in statically through basic_percolation.
+*/
+
+using site = std::tuple<int, int, int>;
+
+// Seed of every engine and counter-based run, so that each commit measures the same work
+constexpr uint64_t bench_seed = 2024;
+
+// Lattice mappings shared by both versions, identical to those of cubic_bond_percolation
+struct cubic_mappings
+{
+  force_inline size_t index(const site& node) const
+  {
+    return static_cast<size_t>(std::get<0>(node)) | (static_cast<size_t>(std::get<1>(node)) << cube_pow) |
+           (static_cast<size_t>(std::get<2>(node)) << (2 * cube_pow));
+  }
+
+  force_inline site element(size_t index) const
+  {
+    const size_t mask = cube_size - 1;
+    return {static_cast<int>(index & mask), static_cast<int>((index >> cube_pow) & mask), static_cast<int>(index >> (2 * cube_pow))};
+  }
+
+  force_inline bool boundary(const site& node) const
+  {
+    return std::get<0>(node) == 0 || std::get<0>(node) == cube_size - 1 || std::get<1>(node) == 0 || std::get<1>(node) == cube_size - 1 ||
+           std::get<2>(node) == 0 || std::get<2>(node) == cube_size - 1;
+  }
+
+  uint8_t cube_pow;
+  int cube_size;
+};
+
+class virtual_cubic_lattice : public percolation<site>
+{
+public:
+  virtual_cubic_lattice(uint8_t cube_pow) : percolation(ipow(2, cube_pow * 3u)), _mappings{cube_pow, ipow(2, cube_pow)}
+  {
+  }
+
+  size_t get_index(const site& node) const override
+  {
+    return _mappings.index(node);
+  }
+  site get_element(size_t index) const override
+  {
+    return _mappings.element(index);
+  }
+  bool on_boundary(const site& node) const override
+  {
+    return _mappings.boundary(node);
+  }
+
+private:
+  const cubic_mappings _mappings;
+};
+
+class static_cubic_lattice : public basic_percolation<static_cubic_lattice, site>
+{
+public:
+  static_cubic_lattice(uint8_t cube_pow) : basic_percolation(ipow(2, cube_pow * 3u)), _mappings{cube_pow, ipow(2, cube_pow)}
+  {
+  }
+
+  force_inline size_t get_index(const site& node) const
+  {
+    return _mappings.index(node);
+  }
+  force_inline site get_element(size_t index) const
+  {
+    return _mappings.element(index);
+  }
+  force_inline bool on_boundary(const site& node) const
+  {
+    return _mappings.boundary(node);
+  }
+
+  // For the find microbenchmarks
+  using basic_percolation::find_root;
+  using basic_percolation::find_root_const;
+
+private:
+  const cubic_mappings _mappings;
+};
+
+// Same loop as cubic_bond_percolation::generate_clusters
+template <typename lattice>
+void generate_clusters(lattice& forest, int cube_size, uint64_t bound, pcg64_fast& rng)
+{
+  site new_node;
+
+  for (std::get<0>(new_node) = 0; std::get<0>(new_node) < cube_size; ++std::get<0>(new_node))
+  {
+    for (std::get<1>(new_node) = 0; std::get<1>(new_node) < cube_size; ++std::get<1>(new_node))
+    {
+      for (std::get<2>(new_node) = 0; std::get<2>(new_node) < cube_size; ++std::get<2>(new_node))
+      {
+        forest.make_set(new_node);
+
+        if (rng() < bound)
+        {
+          forest.merge({std::get<0>(new_node), std::get<1>(new_node), std::max(std::get<2>(new_node) - 1, 0)}, new_node);
+        }
+        if (rng() < bound)
+        {
+          forest.merge({std::get<0>(new_node), std::max(std::get<1>(new_node) - 1, 0), std::get<2>(new_node)}, new_node);
+        }
+        if (rng() < bound)
+        {
+          forest.merge({std::max(std::get<0>(new_node) - 1, 0), std::get<1>(new_node), std::get<2>(new_node)}, new_node);
+        }
+      }
+    }
+  }
+}
+
+// Wall times of the repetitions, and the counts of each counter summed over them, nullopt where some read failed
+struct generation_measurement
+{
+  uint64_t best_ns = std::numeric_limits<uint64_t>::max();
+  uint64_t total_ns = 0;
+  std::vector<std::optional<uint64_t>> totals;
+};
+
+/*
+Times repetitions calls of generate, counting events around each when given counters. A first call is left out as a warm up, so that
+page faults on first touching the forest are not included.
+*/
+template <typename function>
+generation_measurement measure_generation(uint32_t repetitions, function&& generate, perf_counters* counters = nullptr)
+{
+  generate();
+
+  generation_measurement measurement;
+  if (counters)
+  {
+    measurement.totals.assign(counters->events().size(), 0);
+  }
+
+  timer tm;
+  for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+  {
+    if (counters)
+    {
+      counters->start();
+    }
+    tm.restart();
+    generate();
+    tm.stop();
+    if (counters)
+    {
+      counters->stop();
+
+      const auto values = counters->read();
+      for (size_t i = 0; i < measurement.totals.size(); ++i)
+      {
+        measurement.totals[i] = (measurement.totals[i] && values[i]) ? std::optional<uint64_t>(*measurement.totals[i] + *values[i]) : std::nullopt;
+      }
+    }
+
+    measurement.best_ns = std::min(measurement.best_ns, tm.get_ns());
+    measurement.total_ns += tm.get_ns();
+  }
+  return measurement;
+}
+
+// Returns the best throughput over the repetitions, which is the most stable figure on a busy machine
+template <typename lattice>
+double measure_sites_per_second(const std::string& name, uint8_t cube_pow, double p, uint32_t repetitions)
+{
+  lattice forest(cube_pow);
+  pcg64_fast rng(bench_seed);
+  const uint64_t bound = std::numeric_limits<uint64_t>::max() * p;
+  const int cube_size = ipow(2, cube_pow);
+  const double num_sites = static_cast<double>(ipow(size_t(2), cube_pow * 3u));
+
+  const generation_measurement measurement = measure_generation(repetitions, [&]() { generate_clusters(forest, cube_size, bound, rng); });
+
+  const double sites_per_second = num_sites / (measurement.best_ns / 1e9);
+  std::println("{:<10} best {:>8.2f} Msites/s, mean {:>8.2f} Msites/s", name, sites_per_second / 1e6,
+               num_sites * repetitions / (measurement.total_ns / 1e3));
+  return sites_per_second;
+}
+
+/*
+Site layouts: wall time and cache/TLB misses of generating the clusters of a whole cube, serially and in parallel.
+*/
+
+std::string format_count(const std::optional<uint64_t>& count, double scale)
+{
+  return count ? std::format("{:.3f}", *count / scale) : "n/a";
+}
+
+template <typename layout_type>
+void measure_layout(const std::string& name, uint8_t cube_pow, double p, uint32_t repetitions, uint8_t num_threads)
+{
+  cubic_bond_percolation<compact_node<uint32_t>, layout_type> perc(cube_pow, p);
+  perf_counters counters({perf_event::cycles, perf_event::llc_misses, perf_event::dtlb_misses});
+  const double num_sites = static_cast<double>(ipow(size_t(2), cube_pow * 3u));
+
+  for (const bool parallel : {false, true})
+  {
+    const generation_measurement measurement = measure_generation(
+        repetitions, [&]() { parallel ? perc.generate_clusters_parallel(num_threads) : perc.generate_clusters(); }, &counters);
+
+    const double scale = num_sites * repetitions;
+    std::println("{:>8} {:<10} {:>10.1f} {:>14} {:>16} {:>16}", cube_pow, name + (parallel ? " (par)" : ""),
+                 measurement.total_ns / 1e6 / repetitions, format_count(measurement.totals[0], scale), format_count(measurement.totals[1], scale),
+                 format_count(measurement.totals[2], scale));
+  }
+}
+
+/*
+Forest pages: wall time and TLB misses of generating a whole cube in parallel with the forest in each kind of page. Pages which
+cannot be had fall back to smaller ones, so the pages actually used are printed alongside.
+*/
+
+void measure_pages(page_policy pages, uint8_t cube_pow, double p, uint32_t repetitions, uint8_t num_threads)
+{
+  cubic_bond_percolation<compact_node<uint32_t>, row_major_layout> perc(cube_pow, p, pages);
+  perc.set_seed(bench_seed);
+  perf_counters counters({perf_event::cycles, perf_event::dtlb_misses});
+  const double num_sites = static_cast<double>(ipow(size_t(2), cube_pow * 3u));
+
+  const generation_measurement measurement = measure_generation(repetitions, [&]() { perc.generate_clusters_parallel(num_threads); }, &counters);
+
+  const double scale = num_sites * repetitions;
+  std::println("{:>8} {:<20} {:>10.1f} {:>14} {:>16}   {}", cube_pow, huge_page_vector<int>::name(pages), measurement.total_ns / 1e6 / repetitions,
+               format_count(measurement.totals[0], scale), format_count(measurement.totals[1], scale), perc.forest_pages());
+}
+
+/*
+NUMA placement: wall time of parallel generation with the tiled layout, and the share of loads from memory served by a remote
+NUMA node, for each thread affinity. The pool's threads are created after the counters open, so they inherit them and a read counts
+them whether they are still running or have exited; the counters cover the whole life of the simulation, including the first
+generation which places the forest. A row is marked when some thread could not be pinned, or when there are more threads than allowed cores so pinned threads share cores.
+*/
+
+void measure_affinity(thread_affinity affinity, const std::string& name, uint8_t cube_pow, double p, uint32_t repetitions,
+                      uint8_t num_threads)
+{
+  perf_counters counters({perf_event::node_loads, perf_event::node_load_misses});
+  timer tm;
+  const uint64_t pin_failures = numa_topology::pin_failures();
+
+  counters.start();
+  {
+    cubic_bond_percolation<compact_node<uint32_t>, tiled_layout<>> perc(cube_pow, p);
+    perc.set_seed(bench_seed);
+    perc.set_thread_affinity(affinity);
+    perc.generate_clusters_parallel(num_threads);
+
+    for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+    {
+      tm.start();
+      perc.generate_clusters_parallel(num_threads);
+      tm.stop();
+    }
+  }
+  counters.stop();
+
+  const auto values = counters.read();
+  const std::string remote_ratio = values[0] && values[1] && *values[0] > 0 ? std::format("{:.3f}", double(*values[1]) / *values[0]) : "n/a";
+  const char* const pinning = affinity == thread_affinity::none             ? ""
+                              : numa_topology::pin_failures() != pin_failures ? "   (pinning failed)"
+                              : num_threads > numa_topology().num_cpus()      ? "   (shared cores)"
+                                                                              : "";
+  std::println("{:>8} {:<10} {:>10.1f} {:>14}{}", cube_pow, name, tm.get_ns() / 1e6 / repetitions, remote_ratio, pinning);
+}
+
+/*
+Parallel scaling: wall time of generating a whole cube with the slab split and merge tree of generate_clusters_parallel, against
+all threads merging at once through generate_clusters_concurrent, for 1 to 64 threads. Speedups are relative to generate_clusters.
+*/
+
+void measure_scaling(uint8_t cube_pow, double p, uint32_t repetitions)
+{
+  cubic_bond_percolation<compact_node<uint32_t>, row_major_layout> perc(cube_pow, p);
+  perc.generate_clusters();
+
+  const auto best_ms = [&](auto&& generate)
+  {
+    generate();
+    timer tm;
+    uint64_t best_ns = std::numeric_limits<uint64_t>::max();
+    for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+    {
+      tm.restart();
+      generate();
+      tm.stop();
+      best_ns = std::min(best_ns, tm.get_ns());
+    }
+    return best_ns / 1e6;
+  };
+
+  const double serial_ms = best_ms([&]() { perc.generate_clusters(); });
+  std::println("{:>8} {:>8} {:>12.1f}", cube_pow, "serial", serial_ms);
+
+  for (const uint8_t num_threads : {1, 2, 4, 8, 16, 32, 64})
+  {
+    const double split_ms = best_ms([&]() { perc.generate_clusters_parallel(num_threads); });
+    const double concurrent_ms = best_ms([&]() { perc.generate_clusters_concurrent(num_threads); });
+    std::println("{:>8} {:>8} {:>12.1f} {:>10.2f} {:>14.1f} {:>10.2f}", cube_pow, num_threads, split_ms, serial_ms / split_ms, concurrent_ms,
+                 serial_ms / concurrent_ms);
+  }
+}
+
+/*
+Bond sampling: engine calls and throughput of filling bond masks, and the resulting cluster generation time, for each mode over
+a range of p.
+*/
+
+// pcg64_fast which counts its calls
+struct counting_engine
+{
+  uint64_t operator()()
+  {
+    ++calls;
+    return rng();
+  }
+
+  pcg64_fast rng{bench_seed};
+  uint64_t calls = 0;
+};
+
+void measure_sampling(const std::string& name, bond_sampling mode, uint8_t cube_pow, double p, uint32_t repetitions)
+{
+  const size_t num_bonds = size_t(1) << 24;
+  bond_sampler sampler(p, mode);
+  counting_engine rng;
+  std::vector<uint64_t> bonds(num_bonds / 64);
+
+  timer tm;
+  tm.start();
+  sampler.fill(rng, bonds.data(), num_bonds);
+  tm.stop();
+
+  cubic_bond_percolation<compact_node<uint32_t>, row_major_layout> perc(cube_pow, p);
+  perc.set_bond_sampling(mode);
+  perc.generate_clusters();
+
+  timer generation_tm;
+  for (uint32_t repetition = 0; repetition < repetitions; ++repetition)
+  {
+    generation_tm.start();
+    perc.generate_clusters();
+    generation_tm.stop();
+  }
+
+  std::println("{:>6.4f} {:<15} {:>12.4f} {:>14.1f} {:>14.1f}", p, name, static_cast<double>(rng.calls) / num_bonds,
+               num_bonds / (tm.get_ns() / 1e3), generation_tm.get_ns() / 1e6 / repetitions);
+}
+
+/*
+Microbenchmarks of the pieces of a simulation, run through benchmark_suite, with every input drawn from bench_seed.
+*/
+
+template <typename layout_type>
+void bench_layout(benchmark_suite& suite, const std::string& name, uint8_t cube_pow)
+{
+  const layout_type layout(cube_pow);
+  const int cube_size = ipow(2, cube_pow);
+  const size_t num_sites = ipow(size_t(2), cube_pow * 3u);
+  const std::string parameters = std::format("cube_pow={}", cube_pow);
+
+  suite.run("get_index/" + name, parameters, num_sites,
+            [&]()
+            {
+              size_t sum = 0;
+              for (int x = 0; x < cube_size; ++x)
+              {
+                for (int y = 0; y < cube_size; ++y)
+                {
+                  for (int z = 0; z < cube_size; ++z)
+                  {
+                    sum += layout.get_index(x, y, z);
+                  }
+                }
+              }
+              do_not_optimize(sum);
+            });
+
+  suite.run("get_element/" + name, parameters, num_sites,
+            [&]()
+            {
+              size_t sum = 0;
+              for (size_t index = 0; index < num_sites; ++index)
+              {
+                const auto [x, y, z] = layout.get_element(index);
+                sum += x + y + z;
+              }
+              do_not_optimize(sum);
+            });
+}
+
+// Roots of every site of a cube generated at p, with path halving (as in merge) and without (as in counting)
+void bench_find(benchmark_suite& suite, uint8_t cube_pow, double p)
+{
+  static_cubic_lattice forest(cube_pow);
+  const size_t num_sites = ipow(size_t(2), cube_pow * 3u);
+  const uint64_t bound = std::numeric_limits<uint64_t>::max() * p;
+  const std::string parameters = std::format("cube_pow={} p={}", cube_pow, p);
+
+  // Regenerate the same configuration before every run, since path halving shortens the paths it walks
+  const auto generate = [&]()
+  {
+    pcg64_fast rng(bench_seed);
+    generate_clusters(forest, ipow(2, cube_pow), bound, rng);
+  };
+
+  suite.run("find/path_halving", parameters, num_sites, generate,
+            [&]()
+            {
+              size_t sum = 0;
+              for (size_t index = 0; index < num_sites; ++index)
+              {
+                sum += forest.find_root(index);
+              }
+              do_not_optimize(sum);
+            });
+
+  suite.run("find/no_compression", parameters, num_sites, generate,
+            [&]()
+            {
+              size_t sum = 0;
+              for (size_t index = 0; index < num_sites; ++index)
+              {
+                sum += forest.find_root_const(index);
+              }
+              do_not_optimize(sum);
+            });
+}
+
+// Forest over plain indices
+class index_forest : public basic_disjoint_set_forest<index_forest, size_t, compact_node<uint32_t>>
+{
+public:
+  index_forest(size_t num_elements) : basic_disjoint_set_forest(num_elements)
+  {
+  }
+
+  force_inline size_t get_index(size_t node) const
+  {
+    return node;
+  }
+  force_inline size_t get_element(size_t index) const
+  {
+    return index;
+  }
+  force_inline bool on_boundary(size_t) const
+  {
+    return false;
+  }
+
+  void reset()
+  {
+    for (size_t index = 0; index < _num_elements; ++index)
+    {
+      make_set(index);
+    }
+  }
+
+  using basic_disjoint_set_forest::merge_indices;
+};
+
+/*
+Merges of random pairs of elements into a fresh forest, for different cluster size distributions: mostly small clusters (sparse,
+and local pairs at most 64 apart), a power law of sizes (critical, as for random graphs with n / 2 edges) and a giant cluster that
+most merges find already joined (dense).
+*/
+void bench_merge(benchmark_suite& suite, uint8_t cube_pow)
+{
+  const size_t num_elements = ipow(size_t(2), cube_pow * 3u);
+  index_forest forest(num_elements);
+
+  const auto random_pairs = [&](size_t num_pairs, size_t max_distance)
+  {
+    pcg64_fast rng(bench_seed);
+    std::vector<std::pair<size_t, size_t>> pairs(num_pairs);
+    for (auto& [index1, index2] : pairs)
+    {
+      index1 = rng() % num_elements;
+      index2 = max_distance == 0 ? rng() % num_elements : (index1 + 1 + rng() % max_distance) % num_elements;
+    }
+    return pairs;
+  };
+
+  const std::tuple<std::string, size_t, size_t> distributions[] = {
+      {"sparse", num_elements / 4, 0},
+      {"local", num_elements / 2, 64},
+      {"critical", num_elements / 2, 0},
+      {"dense", 2 * num_elements, 0},
+  };
+
+  for (const auto& [name, num_pairs, max_distance] : distributions)
+  {
+    const std::vector<std::pair<size_t, size_t>> pairs = random_pairs(num_pairs, max_distance);
+    suite.run("merge/" + name, std::format("elements=2^{} pairs={}", 3 * cube_pow, num_pairs), num_pairs, [&]() { forest.reset(); },
+              [&]()
+              {
+                for (const auto& [index1, index2] : pairs)
+                {
+                  forest.merge_indices(index1, index2);
+                }
+              });
+  }
+}
+
+// Raw throughput of pcg64_fast against the generators of xorshift.h
+void bench_generators(benchmark_suite& suite)
+{
+  const size_t num_calls = size_t(1) << 26;
+  const std::string parameters = std::format("calls={}", num_calls);
+
+  const auto bench_engine = [&](const std::string& name, auto&& next)
+  {
+    suite.run("rng/" + name, parameters, num_calls,
+              [&]()
+              {
+                uint64_t sum = 0;
+                for (size_t call = 0; call < num_calls; ++call)
+                {
+                  sum += next();
+                }
+                do_not_optimize(sum);
+              });
+  };
+
+  pcg64_fast pcg(bench_seed);
+  prng xorshift(bench_seed);
+  bench_engine("pcg64_fast", [&]() { return pcg(); });
+  bench_engine("xorshift_64", [&]() { return xorshift.next_xorshift_64(); });
+  bench_engine("xorshift_64s", [&]() { return xorshift.next_xorshift_64s(); });
+  bench_engine("lcg_64", [&]() { return xorshift.next_lcg_64(); });
+}
+
+// Whole cubes, serially and in parallel, with counter-based bonds so every run generates the same configuration
+void bench_generation(benchmark_suite& suite, uint8_t cube_pow, double p, uint32_t max_threads)
+{
+  cubic_bond_percolation<compact_node<uint32_t>, row_major_layout> perc(cube_pow, p);
+  perc.set_seed(bench_seed);
+  const size_t num_sites = ipow(size_t(2), cube_pow * 3u);
+
+  suite.run("generate_clusters", std::format("cube_pow={}", cube_pow), num_sites, [&]() { perc.generate_clusters(); });
+
+  for (uint32_t num_threads = 1; num_threads <= max_threads; num_threads *= 2)
+  {
+    suite.run("generate_clusters_parallel", std::format("cube_pow={} threads={}", cube_pow, num_threads), num_sites,
+              [&]() { perc.generate_clusters_parallel(num_threads); });
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const uint8_t min_cube_pow = argc > 1 ? std::stoi(argv[1]) : 8;
+  const uint8_t max_cube_pow = argc > 2 ? std::stoi(argv[2]) : 10;
+  const uint32_t repetitions = argc > 3 ? std::stoi(argv[3]) : 3;
+  const std::string json_path = argc > 4 ? argv[4] : ""; // Microbenchmark results are written here as JSON if given
+  const uint8_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  const double p = 0.2488;
+
+  std::println("Microbenchmarks, 1 warm up run and {} repetitions each", repetitions);
+  benchmark_suite suite(1, repetitions);
+  benchmark_suite::print_heading();
+
+  bench_layout<row_major_layout>(suite, "row_major", min_cube_pow);
+  bench_layout<morton_layout>(suite, "morton", min_cube_pow);
+  bench_layout<tiled_layout<>>(suite, "tiled", min_cube_pow);
+  bench_find(suite, min_cube_pow, p);
+  bench_merge(suite, min_cube_pow);
+  bench_generators(suite);
+  for (uint8_t cube_pow = min_cube_pow; cube_pow <= max_cube_pow; ++cube_pow)
+  {
+    bench_generation(suite, cube_pow, p, num_threads);
+  }
+
+  if (!json_path.empty())
+  {
+    suite.write_json(json_path);
+  }
+
+  std::println("");
+
+  std::println("Cluster generation, cube_pow={}, p={}, {} repetitions", min_cube_pow, p, repetitions);
+
+  const double before = measure_sites_per_second<virtual_cubic_lattice>("virtual", min_cube_pow, p, repetitions);
+  const double after = measure_sites_per_second<static_cubic_lattice>("static", min_cube_pow, p, repetitions);
+
+  std::println("Speedup: {:.2f}x", after / before);
+
+  std::println("\nBond sampling, cube_pow={}", min_cube_pow);
+  std::println("{:>6} {:<15} {:>12} {:>14} {:>14}", "p", "mode", "calls/bond", "Mbonds/s", "generation ms");
+  for (const double sampling_p : {0.05, 0.1, 0.15, 0.2, 0.2488, 0.3, 0.4, 0.5})
+  {
+    measure_sampling("per_bond", bond_sampling::per_bond, min_cube_pow, sampling_p, repetitions);
+    measure_sampling("bit_masks", bond_sampling::bit_masks, min_cube_pow, sampling_p, repetitions);
+    measure_sampling("geometric_gaps", bond_sampling::geometric_gaps, min_cube_pow, sampling_p, repetitions);
+  }
+
+  std::println("\nSite layouts, p={}, {} repetitions, {} threads for parallel generation", p, repetitions, num_threads);
+  std::println("{:>8} {:<16} {:>10} {:>14} {:>16} {:>16}", "cube_pow", "layout", "ms", "cycles/site", "llc_misses/site", "dtlb_misses/site");
+
+  for (uint8_t cube_pow = min_cube_pow; cube_pow <= max_cube_pow; ++cube_pow)
+  {
+    measure_layout<row_major_layout>("row_major", cube_pow, p, repetitions, num_threads);
+    measure_layout<morton_layout>("morton", cube_pow, p, repetitions, num_threads);
+    measure_layout<tiled_layout<>>("tiled", cube_pow, p, repetitions, num_threads);
+  }
+
+  std::println("\nForest pages, p={}, {} repetitions, {} threads", p, repetitions, num_threads);
+  std::println("{:>8} {:<20} {:>10} {:>14} {:>16}   {}", "cube_pow", "requested", "ms", "cycles/site", "dtlb_misses/site", "obtained");
+
+  for (uint8_t cube_pow = min_cube_pow; cube_pow <= max_cube_pow; ++cube_pow)
+  {
+    for (const page_policy pages : {page_policy::normal, page_policy::transparent, page_policy::huge_2m, page_policy::huge_1g})
+    {
+      measure_pages(pages, cube_pow, p, repetitions, num_threads);
+    }
+  }
+
+  std::println("\nNUMA placement, tiled layout, p={}, {} repetitions, {} threads on {} nodes", p, repetitions, num_threads,
+               numa_topology().num_nodes());
+  std::println("{:>8} {:<10} {:>10} {:>14}", "cube_pow", "affinity", "ms", "remote ratio");
+
+  for (uint8_t cube_pow = min_cube_pow; cube_pow <= max_cube_pow; ++cube_pow)
+  {
+    measure_affinity(thread_affinity::none, "none", cube_pow, p, repetitions, num_threads);
+    measure_affinity(thread_affinity::compact, "compact", cube_pow, p, repetitions, num_threads);
+    measure_affinity(thread_affinity::scatter, "scatter", cube_pow, p, repetitions, num_threads);
+  }
+
+  std::println("\nParallel scaling, p={}, best of {} repetitions, {} hardware threads", p, repetitions, std::thread::hardware_concurrency());
+  std::println("{:>8} {:>8} {:>12} {:>10} {:>14} {:>10}", "cube_pow", "threads", "split ms", "speedup", "concurrent ms", "speedup");
+  measure_scaling(max_cube_pow, p, repetitions);
+
+  return 0;
+}